@@ -0,0 +1,121 @@
+/*
+SW Timer benchmark.
+Compares the find_minimal_remain kernels of the flat backend against the scalar loop it used before them,
+for the timer counts the flat backend is meant for. Built from the timer engine source without its main:
+cl /O2 SW_Timer_bench.c
+*/
+
+#define SW_TIMER_NO_MAIN
+#define TMR_BACKEND 0 // TMR_BACKEND_FLAT - the kernels belong to the flat backend
+#include "SW_Timer_executable.c"
+
+#define BENCH_MAX_TIMERS 4096
+#define BENCH_CALLS_PER_RUN 20000 // find_minimal_remain calls timed per kernel and timer count
+
+typedef struct {
+	const char* name;
+	min_key_kernel_t kernel;
+} bench_kernel_t;
+
+uint32 bench_deadline[BENCH_MAX_TIMERS];
+uint32 bench_wait_us[BENCH_MAX_TIMERS]; // 0 for inactive entries, like timer_wait_us[]
+uint64 bench_active[BENCH_MAX_TIMERS / 64];
+uint64 bench_active_summary[1]; // BENCH_MAX_TIMERS / 64 bitmap words fit one summary word
+volatile uint32 bench_sink; // Keeps the compiler from dropping the timed calls
+
+// The scalar loop find_minimal_remain used before the kernels - one branch per entry on the interval
+uint32 legacy_min_key(const uint32* deadlines, const uint32* wait_us, uint32 timers_num, uint32 ref)
+{
+	uint32 minimal_rem = 0xffffffff;
+	for (uint32 i = 0; i < timers_num; i++) {
+		// Skip inactive timer entries
+		if (wait_us[i] == 0)
+			continue;
+
+		uint32 rem_i = deadlines[i] - ref;
+		if (rem_i < minimal_rem)
+			minimal_rem = rem_i;
+	}
+	return minimal_rem;
+}
+
+/* This function fills the first timers_num bench entries, active_percent of them active,
+* with deadlines within 1s after ref
+*/
+void bench_fill(uint32 timers_num, uint32 active_percent, uint32 ref)
+{
+	memset(bench_active, 0, sizeof(bench_active));
+	bench_active_summary[0] = 0;
+	srand(timers_num + active_percent);
+	for (uint32 i = 0; i < timers_num; i++) {
+		BOOL active = (uint32)(rand() % 100) < active_percent;
+		bench_wait_us[i] = active ? 1 + (uint32)rand() : 0;
+		bench_deadline[i] = ref + (((uint32)rand() << 15 | (uint32)rand()) % TMR_FREQ_HZ);
+		if (active) {
+			bench_active[i / 64] |= 1ULL << (i % 64);
+			bench_active_summary[0] |= 1ULL << (i / 64);
+		}
+	}
+}
+
+// Returns the elapsed time between two port clock readings in nanoseconds
+double bench_elapsed_ns(uint64 start, uint64 end, uint64 freq)
+{
+	return (double)(end - start) * 1e9 / (double)freq;
+}
+
+int main() {
+
+	// The kernels up to the one queue_init would pick are supported by this CPU
+	bench_kernel_t kernels[] = {
+		{ "scalar", min_key_scalar },
+#if TMR_HAVE_X86_SIMD
+		{ "sse4.1", min_key_sse41 },
+		{ "avx2", min_key_avx2 },
+#endif
+	};
+	min_key_kernel_t selected = select_min_key_kernel();
+	int kernels_num = 0;
+	while (kernels[kernels_num].kernel != selected)
+		kernels_num++;
+	kernels_num++;
+
+	uint32 timer_counts[] = { 64, 256, 1024, 4096 };
+	uint32 active_percents[] = { 100, 25 };
+	uint32 ref = 0xfff00000; // Deadlines wrap around during the run
+	uint64 freq = port_clock_freq();
+	uint64 start, end;
+
+	printf("%-8s %8s %-8s %12s %12s\n", "timers", "active", "kernel", "ns/call", "speedup");
+	for (int c = 0; c < (int)(sizeof(timer_counts) / sizeof(timer_counts[0])); c++) {
+		for (int a = 0; a < (int)(sizeof(active_percents) / sizeof(active_percents[0])); a++) {
+			uint32 timers_num = timer_counts[c];
+			bench_fill(timers_num, active_percents[a], ref);
+			uint32 expected = legacy_min_key(bench_deadline, bench_wait_us, timers_num, ref);
+
+			start = port_clock();
+			for (int i = 0; i < BENCH_CALLS_PER_RUN; i++)
+				bench_sink = legacy_min_key(bench_deadline, bench_wait_us, timers_num, ref + (i & 1));
+			end = port_clock();
+			double legacy_ns = bench_elapsed_ns(start, end, freq) / BENCH_CALLS_PER_RUN;
+			printf("%-8u %7u%% %-8s %12.1f %12s\n", timers_num, active_percents[a], "legacy", legacy_ns, "1.00x");
+
+			for (int k = 0; k < kernels_num; k++) {
+				if (kernels[k].kernel(bench_deadline, bench_active, bench_active_summary, 1, ref) != expected) {
+					printf("ERROR: %s kernel disagrees with the legacy loop\n", kernels[k].name);
+					return 1;
+				}
+
+				start = port_clock();
+				for (int i = 0; i < BENCH_CALLS_PER_RUN; i++)
+					bench_sink = kernels[k].kernel(bench_deadline, bench_active, bench_active_summary, 1, ref + (i & 1));
+				end = port_clock();
+				double kernel_ns = bench_elapsed_ns(start, end, freq) / BENCH_CALLS_PER_RUN;
+				printf("%-8u %7u%% %-8s %12.1f %11.2fx\n", timers_num, active_percents[a], kernels[k].name, kernel_ns, legacy_ns / kernel_ns);
+			}
+		}
+	}
+
+	printf("find_minimal_remain uses the %s kernel on this CPU\n", kernels[kernels_num - 1].name);
+	return 0;
+}
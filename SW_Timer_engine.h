@@ -0,0 +1,412 @@
+/*
+SW Timer embeddable engine.
+A header-only build of the timer engine's core for products that need several configurations of it in one binary:
+TimerEngine<Capacity, TickHz, CounterT, Backend> keeps Capacity timers on a free running CounterT counter that
+counts TickHz ticks per second, in a flat or binary heap queue like TMR_BACKEND_FLAT/TMR_BACKEND_HEAP. Every size
+is a template argument, so the timer state is fixed-size arrays in the object, the queue loops have compile-time trip
+counts the compiler unrolls for small engines, and the microsecond to tick conversions are constexpr.
+An engine needs no dynamic allocation and no constructor - a zero-initialized object (a global) is an engine with
+no active timers, and the first timer set on it (or on any engine with no timer queued) takes its counter value as
+the base of the deadlines, so the counter doesn't need to start at 0. It has no threads either: the application calls interrupt() from its compare interrupt with the
+counter value, and after set/remove calls like the engine's software interrupt, then programs the compare register
+with the value it returns. Calls on one engine must not run concurrently.
+Deadlines are compared by their distance from the last interrupt, so the counter may wrap around; intervals are
+limited to half of the counter range (max_cmp_distance ticks).
+
+From C, one C++ file defines a fixed engine with SW_TIMER_DEFINE_C_API and the C files declare its functions with
+SW_TIMER_DECLARE_C_API:
+	// engine.cpp
+	#include "SW_Timer_engine.h"
+	SW_TIMER_DEFINE_C_API(motor_timers, 16, 32768, uint16_t, sw_timer::Backend::Flat)
+	// main.c
+	#include "SW_Timer_engine.h"
+	SW_TIMER_DECLARE_C_API(motor_timers, uint16_t)
+	...
+	// counter_value is the counter read just before, any value - the engine has no timer queued yet
+	motor_timers_set_timer(0, counter_value, 2000, on_timer, NULL);
+	cmp_reg = motor_timers_interrupt(counter_value); // Like the software interrupt, then from the compare interrupt
+*/
+
+#ifndef SW_TIMER_ENGINE_H
+#define SW_TIMER_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__cplusplus) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#ifdef __cplusplus
+#define SW_TIMER_EXTERN_C extern "C"
+#else
+#define SW_TIMER_EXTERN_C
+#endif
+
+typedef void (*sw_timer_cb_t)(uint32_t timer_id, void* ctx); // Called from interrupt() every time a timer fires
+
+// The C functions of an engine defined with SW_TIMER_DEFINE_C_API, returning 1 on success and 0 on failure
+#define SW_TIMER_DECLARE_C_API(prefix, counter_type) \
+	SW_TIMER_EXTERN_C int prefix##_set_timer(uint32_t timer_id, counter_type now, uint64_t interval_us, sw_timer_cb_t cb, void* ctx); \
+	SW_TIMER_EXTERN_C int prefix##_set_timer_once(uint32_t timer_id, counter_type now, uint64_t timeout_us, sw_timer_cb_t cb, void* ctx); \
+	SW_TIMER_EXTERN_C int prefix##_remove_timer(uint32_t timer_id); \
+	SW_TIMER_EXTERN_C int prefix##_is_active(uint32_t timer_id); \
+	SW_TIMER_EXTERN_C uint32_t prefix##_times_fired(uint32_t timer_id); \
+	SW_TIMER_EXTERN_C counter_type prefix##_interrupt(counter_type now);
+
+#ifdef __cplusplus
+
+namespace sw_timer {
+
+// Timer queues, with the values of TMR_BACKEND_FLAT and TMR_BACKEND_HEAP
+enum class Backend { Flat = 0, Heap = 1 };
+
+namespace detail {
+
+// Index of the lowest set bit, x must not be 0
+inline uint32_t bit_scan_forward64(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return (uint32_t)i;
+#else
+	return (uint32_t)__builtin_ctzll(x);
+#endif
+}
+
+/* Timer queue of an engine - the timers ordered by their deadline's distance from base, the counter value of the
+* last interrupt (serial arithmetic, like the engine's DEADLINE_KEY). Zero-initialized it is empty.
+*/
+template <uint32_t Capacity, typename CounterT, Backend QueueBackend>
+class TimerQueue;
+
+// Flat queue - a bitmap of the queued timers, scanned for the earliest deadline
+template <uint32_t Capacity, typename CounterT>
+class TimerQueue<Capacity, CounterT, Backend::Flat> {
+public:
+	static constexpr uint32_t words = (Capacity + 63) / 64;
+
+	void insert(uint32_t timer_id, const CounterT*, CounterT) { queued_[timer_id / 64] |= 1ULL << (timer_id % 64); }
+	void remove(uint32_t timer_id, const CounterT*, CounterT) { queued_[timer_id / 64] &= ~(1ULL << (timer_id % 64)); }
+	bool is_queued(uint32_t timer_id) const { return (queued_[timer_id / 64] >> (timer_id % 64)) & 1; }
+
+	bool empty() const
+	{
+		uint64_t queued = 0;
+		for (uint32_t w = 0; w < words; w++)
+			queued |= queued_[w];
+		return queued == 0;
+	}
+
+	// Returns the queued timer with the earliest deadline, Capacity if none is queued
+	uint32_t peek(const CounterT* deadline, CounterT base) const
+	{
+		uint32_t min_id = Capacity;
+		CounterT min_key = 0;
+		for (uint32_t w = 0; w < words; w++) {
+			for (uint64_t bits = queued_[w]; bits != 0; bits &= bits - 1) {
+				uint32_t timer_id = w * 64 + bit_scan_forward64(bits);
+				CounterT key = (CounterT)(deadline[timer_id] - base);
+				if (min_id == Capacity || key < min_key) {
+					min_id = timer_id;
+					min_key = key;
+				}
+			}
+		}
+		return min_id;
+	}
+
+	/* This function takes every queued timer whose key is not above elapsed into expired[]
+	* Returns the number of expired timers
+	*/
+	uint32_t collect_expired(const CounterT* deadline, CounterT base, CounterT elapsed, uint32_t* expired)
+	{
+		uint32_t expired_num = 0;
+		for (uint32_t w = 0; w < words; w++) {
+			for (uint64_t bits = queued_[w]; bits != 0; bits &= bits - 1) {
+				uint32_t timer_id = w * 64 + bit_scan_forward64(bits);
+				if ((CounterT)(deadline[timer_id] - base) <= elapsed) {
+					queued_[w] &= ~(1ULL << (timer_id % 64));
+					expired[expired_num++] = timer_id;
+				}
+			}
+		}
+		return expired_num;
+	}
+
+private:
+	uint64_t queued_[words]; // Bit (id % 64) of word (id / 64) is set when the timer is queued
+};
+
+// Binary min-heap queue, on deadline keys like the engine's heap backend
+template <uint32_t Capacity, typename CounterT>
+class TimerQueue<Capacity, CounterT, Backend::Heap> {
+public:
+	void insert(uint32_t timer_id, const CounterT* deadline, CounterT base)
+	{
+		uint32_t pos = size_++;
+		heap_[pos] = timer_id;
+		pos_[timer_id] = pos + 1;
+		sift_up(pos, deadline, base);
+	}
+
+	// This function takes a queued timer out of the heap, moving the last entry into the hole
+	void remove(uint32_t timer_id, const CounterT* deadline, CounterT base)
+	{
+		if (pos_[timer_id] == 0)
+			return;
+		uint32_t pos = pos_[timer_id] - 1;
+		uint32_t last = --size_;
+		if (pos != last) {
+			swap(pos, last);
+			sift_down(pos, deadline, base);
+			sift_up(pos, deadline, base);
+		}
+		pos_[timer_id] = 0;
+	}
+
+	bool is_queued(uint32_t timer_id) const { return pos_[timer_id] != 0; }
+	bool empty() const { return size_ == 0; }
+
+	// Returns the queued timer with the earliest deadline, Capacity if none is queued
+	uint32_t peek(const CounterT*, CounterT) const { return size_ > 0 ? heap_[0] : Capacity; }
+
+	/* This function pops every queued timer whose key is not above elapsed into expired[]
+	* Returns the number of expired timers
+	*/
+	uint32_t collect_expired(const CounterT* deadline, CounterT base, CounterT elapsed, uint32_t* expired)
+	{
+		uint32_t expired_num = 0;
+		while (size_ > 0 && (CounterT)(deadline[heap_[0]] - base) <= elapsed) {
+			uint32_t timer_id = heap_[0];
+			remove(timer_id, deadline, base);
+			expired[expired_num++] = timer_id;
+		}
+		return expired_num;
+	}
+
+private:
+	void swap(uint32_t pos_a, uint32_t pos_b)
+	{
+		uint32_t id_a = heap_[pos_a];
+		uint32_t id_b = heap_[pos_b];
+		heap_[pos_a] = id_b;
+		heap_[pos_b] = id_a;
+		pos_[id_b] = pos_a + 1;
+		pos_[id_a] = pos_b + 1;
+	}
+
+	void sift_up(uint32_t pos, const CounterT* deadline, CounterT base)
+	{
+		while (pos > 0) {
+			uint32_t parent = (pos - 1) / 2;
+			if ((CounterT)(deadline[heap_[parent]] - base) <= (CounterT)(deadline[heap_[pos]] - base))
+				break;
+			swap(pos, parent);
+			pos = parent;
+		}
+	}
+
+	void sift_down(uint32_t pos, const CounterT* deadline, CounterT base)
+	{
+		while (true) {
+			uint32_t smallest = pos;
+			uint32_t left = 2 * pos + 1;
+			uint32_t right = left + 1;
+			if (left < size_ && (CounterT)(deadline[heap_[left]] - base) < (CounterT)(deadline[heap_[smallest]] - base))
+				smallest = left;
+			if (right < size_ && (CounterT)(deadline[heap_[right]] - base) < (CounterT)(deadline[heap_[smallest]] - base))
+				smallest = right;
+			if (smallest == pos)
+				break;
+			swap(pos, smallest);
+			pos = smallest;
+		}
+	}
+
+	uint32_t heap_[Capacity]; // Queued timer IDs, ordered as a binary min-heap on deadline
+	uint32_t pos_[Capacity]; // Index + 1 of each timer in the heap, 0 if not queued - so zero is an empty heap
+	uint32_t size_;
+};
+
+} // namespace detail
+
+template <uint32_t Capacity, uint32_t TickHz = 1000000, typename CounterT = uint32_t, Backend QueueBackend = Backend::Heap>
+class TimerEngine {
+	static_assert(Capacity > 0, "TimerEngine needs at least one timer");
+	static_assert(TickHz > 0, "TimerEngine needs a counting counter");
+	static_assert(CounterT(0) < CounterT(-1), "The counter type must be unsigned");
+
+public:
+	typedef CounterT counter_t;
+	typedef uint32_t timer_id_t;
+
+	static constexpr uint32_t capacity = Capacity;
+	static constexpr uint32_t tick_hz = TickHz;
+	static constexpr CounterT max_cmp_distance = (CounterT)(CounterT(-1) >> 1); // Further ahead would look passed
+
+	/* Converts microseconds to ticks, rounded up so a timer never fires early. Whole seconds and the rest are
+	* converted apart so us * TickHz can't wrap, a time beyond 64-bit ticks is UINT64_MAX - which arm rejects
+	*/
+	static constexpr uint64_t us_to_ticks(uint64_t us)
+	{
+		return us / 1000000 > (UINT64_MAX - TickHz) / TickHz ? UINT64_MAX :
+			us / 1000000 * TickHz + (us % 1000000 * TickHz + 999999) / 1000000;
+	}
+
+	// Converts ticks to microseconds, rounded down, UINT64_MAX beyond 64-bit microseconds - split like us_to_ticks
+	static constexpr uint64_t ticks_to_us(uint64_t ticks)
+	{
+		return ticks / TickHz > (UINT64_MAX - 1000000) / 1000000 ? UINT64_MAX :
+			ticks / TickHz * 1000000 + ticks % TickHz * 1000000 / TickHz;
+	}
+
+	/* This function sets a periodic timer firing every interval_us (rounded up to ticks), counted from the counter
+	* value now. Setting an active timer restarts it.
+	* Returns false for an invalid timer ID or an interval of no ticks or over max_cmp_distance
+	*/
+	bool set_timer(timer_id_t timer_id, CounterT now, uint64_t interval_us, sw_timer_cb_t cb, void* ctx)
+	{
+		return arm(timer_id, now, us_to_ticks(interval_us), false, cb, ctx);
+	}
+
+	// This function sets a timer to fire once, timeout_us after the counter value now. Returns false like set_timer
+	bool set_timer_once(timer_id_t timer_id, CounterT now, uint64_t timeout_us, sw_timer_cb_t cb, void* ctx)
+	{
+		return arm(timer_id, now, us_to_ticks(timeout_us), true, cb, ctx);
+	}
+
+	// set_timer with the interval in ticks - us_to_ticks of a constant folds at compile time
+	bool set_timer_ticks(timer_id_t timer_id, CounterT now, uint64_t interval, sw_timer_cb_t cb, void* ctx)
+	{
+		return arm(timer_id, now, interval, false, cb, ctx);
+	}
+
+	// This function deactivates a timer. Returns false for an invalid or inactive timer
+	bool remove_timer(timer_id_t timer_id)
+	{
+		if (!is_active(timer_id))
+			return false;
+		disarm(timer_id);
+		return true;
+	}
+
+	bool is_active(timer_id_t timer_id) const
+	{
+		return timer_id < Capacity && ((active_[timer_id / 64] >> (timer_id % 64)) & 1);
+	}
+
+	uint32_t times_fired(timer_id_t timer_id) const { return timer_id < Capacity ? times_fired_[timer_id] : 0; }
+	uint32_t overruns(timer_id_t timer_id) const { return timer_id < Capacity ? overruns_[timer_id] : 0; }
+
+	/* Timer interrupt - fires every timer due by the counter value now and reloads the periodic ones, like the
+	* engine's timer_interrupt, then dispatches their callbacks, which may set or remove timers.
+	* Returns the compare value of the next interrupt, at most max_cmp_distance ahead
+	*/
+	CounterT interrupt(CounterT now)
+	{
+		CounterT elapsed = (CounterT)(now - last_update_);
+		uint32_t expired_num = queue_.collect_expired(deadline_, last_update_, elapsed, expired_);
+		last_update_ = now;
+
+		// Periods follow the deadlines, a timer that fell whole periods behind skips them as overruns
+		for (uint32_t i = 0; i < expired_num; i++) {
+			timer_id_t timer_id = expired_[i];
+			times_fired_[timer_id]++;
+			if (one_shot_[timer_id])
+				continue;
+			CounterT late = (CounterT)(now - deadline_[timer_id]);
+			CounterT missed = (CounterT)(late / wait_[timer_id]);
+			overruns_[timer_id] += missed;
+			deadline_[timer_id] = (CounterT)(deadline_[timer_id] + (CounterT)(missed + 1) * wait_[timer_id]);
+			queue_.insert(timer_id, deadline_, last_update_);
+		}
+
+		// All timers that expired are dispatched as one batch, with the queue already consistent
+		for (uint32_t i = 0; i < expired_num; i++) {
+			timer_id_t timer_id = expired_[i];
+			if (!is_active(timer_id))
+				continue; // An earlier callback of the batch removed it
+			sw_timer_cb_t cb = cb_[timer_id];
+			void* ctx = cb_ctx_[timer_id];
+			if (one_shot_[timer_id])
+				disarm(timer_id); // The callback may set it again
+			if (cb != NULL)
+				cb(timer_id, ctx);
+		}
+		return next_cmp();
+	}
+
+	// Returns the compare value for the current queue, at most max_cmp_distance after the last interrupt
+	CounterT next_cmp() const
+	{
+		uint32_t timer_id = queue_.peek(deadline_, last_update_);
+		CounterT remain = timer_id == Capacity ? max_cmp_distance : (CounterT)(deadline_[timer_id] - last_update_);
+		return (CounterT)(last_update_ + (remain < max_cmp_distance ? remain : max_cmp_distance));
+	}
+
+private:
+	static constexpr uint32_t words = (Capacity + 63) / 64;
+
+	bool arm(timer_id_t timer_id, CounterT now, uint64_t wait, bool one_shot, sw_timer_cb_t cb, void* ctx)
+	{
+		if (timer_id >= Capacity || wait == 0 || wait > max_cmp_distance)
+			return false;
+		// With no timer queued the keys have no base to keep - it moves to now, so the first timer of a new or idle
+		// engine is measured from the real counter value and not from the last interrupt, however long ago that was
+		if (queue_.empty())
+			last_update_ = now;
+		// Counter values before the last interrupt are taken for it, a deadline must stay after it
+		else if ((CounterT)(now - last_update_) > max_cmp_distance)
+			now = last_update_;
+
+		queue_.remove(timer_id, deadline_, last_update_);
+		deadline_[timer_id] = (CounterT)(now + (CounterT)wait);
+		wait_[timer_id] = (CounterT)wait;
+		one_shot_[timer_id] = one_shot;
+		times_fired_[timer_id] = 0;
+		overruns_[timer_id] = 0;
+		cb_[timer_id] = cb;
+		cb_ctx_[timer_id] = ctx;
+		active_[timer_id / 64] |= 1ULL << (timer_id % 64);
+		queue_.insert(timer_id, deadline_, last_update_);
+		return true;
+	}
+
+	void disarm(timer_id_t timer_id)
+	{
+		queue_.remove(timer_id, deadline_, last_update_);
+		active_[timer_id / 64] &= ~(1ULL << (timer_id % 64));
+	}
+
+	// Timer state as a struct of arrays, like the engine's
+	CounterT deadline_[Capacity]; // The counter value of the next fire
+	CounterT wait_[Capacity]; // The interval of the timer in ticks
+	uint64_t active_[words]; // Bit (id % 64) of word (id / 64) is set when the timer is active
+	bool one_shot_[Capacity];
+	uint32_t times_fired_[Capacity];
+	uint32_t overruns_[Capacity];
+	sw_timer_cb_t cb_[Capacity];
+	void* cb_ctx_[Capacity];
+	uint32_t expired_[Capacity]; // Timers collected by the current interrupt call
+	CounterT last_update_; // The counter value of the last interrupt, deadlines are keyed from it
+	detail::TimerQueue<Capacity, CounterT, QueueBackend> queue_;
+};
+
+} // namespace sw_timer
+
+// Defines the C functions of SW_TIMER_DECLARE_C_API on a static engine instance - in one C++ file of the program
+#define SW_TIMER_DEFINE_C_API(prefix, capacity, tick_hz, counter_type, backend) \
+	static sw_timer::TimerEngine<capacity, tick_hz, counter_type, backend> prefix##_engine; \
+	SW_TIMER_EXTERN_C int prefix##_set_timer(uint32_t timer_id, counter_type now, uint64_t interval_us, sw_timer_cb_t cb, void* ctx) \
+		{ return prefix##_engine.set_timer(timer_id, now, interval_us, cb, ctx); } \
+	SW_TIMER_EXTERN_C int prefix##_set_timer_once(uint32_t timer_id, counter_type now, uint64_t timeout_us, sw_timer_cb_t cb, void* ctx) \
+		{ return prefix##_engine.set_timer_once(timer_id, now, timeout_us, cb, ctx); } \
+	SW_TIMER_EXTERN_C int prefix##_remove_timer(uint32_t timer_id) { return prefix##_engine.remove_timer(timer_id); } \
+	SW_TIMER_EXTERN_C int prefix##_is_active(uint32_t timer_id) { return prefix##_engine.is_active(timer_id); } \
+	SW_TIMER_EXTERN_C uint32_t prefix##_times_fired(uint32_t timer_id) { return prefix##_engine.times_fired(timer_id); } \
+	SW_TIMER_EXTERN_C counter_type prefix##_interrupt(counter_type now) { return prefix##_engine.interrupt(now); }
+
+#endif // __cplusplus
+
+#endif
@@ -0,0 +1,191 @@
+/*
+SW Timer engine benchmark.
+Drives the timer engine with a simulated tmr_val_reg - no hw timer or ISR thread runs, the benchmark calls
+timer_interrupt itself - and measures the throughput and per-operation latency percentiles of
+arming, cancelling and expiring timers, for 10 to 1M timers and a few deadline distributions.
+The backend is chosen at build time like in the engine, each build prints rows in the same format, so one
+command line compares all of them:
+for %b in (0 1 2) do @(cl /nologo /O2 /DTMR_BACKEND=%b /FeSW_Timer_engine_bench%b.exe SW_Timer_engine_bench.c >nul && SW_Timer_engine_bench%b.exe)
+*/
+
+#define SW_TIMER_NO_MAIN
+#ifndef TMR_NUM
+#define TMR_NUM (1 << 20) // The largest timer count measured
+#endif
+#define TMR_STATS 0 // The engine's own statistics would be measured along
+#define TMR_SIM_CLOCK 0 // TMR_SIM_CLOCK_STEP - register writes don't wake a tickless hw timer thread
+#include "SW_Timer_executable.c"
+
+#ifndef BENCH_OPS
+#define BENCH_OPS 1000 // Operations timed per phase, timer count and workload
+#endif
+#define BENCH_SPREAD_US 1000000 // Intervals are spread over 1s
+
+// Deadline distributions of the timers
+typedef enum {
+	BENCH_UNIFORM, // Intervals uniform over BENCH_SPREAD_US
+	BENCH_BURSTY, // Intervals in 16 tight bursts, many timers per interrupt
+	BENCH_SAME, // All timers have the same interval and expire together
+	BENCH_WORKLOADS
+} bench_workload_t;
+
+const char* bench_workload_names[BENCH_WORKLOADS] = { "uniform", "bursty", "same" };
+const char* bench_backend_names[] = { "flat", "heap", "wheel" }; // Indexed by TMR_BACKEND
+uint32 bench_counts[] = { 10, 1000, 100000, 1000000 };
+
+double bench_op_ns[BENCH_OPS]; // Duration of each operation of the current phase
+uint32 bench_rng = 1;
+double bench_ns_per_tick; // Duration of a bench_now tick
+uint64 bench_fired = 0; // Fires counted by bench_count_fire
+
+// Callback of every benchmark timer
+void bench_count_fire(timer_id_t timer_id, void* ctx)
+{
+	bench_fired++;
+}
+
+// xorshift32 - rand() has only 15 bits on some C runtimes
+uint32 bench_rand()
+{
+	bench_rng ^= bench_rng << 13;
+	bench_rng ^= bench_rng >> 17;
+	bench_rng ^= bench_rng << 5;
+	return bench_rng;
+}
+
+// Returns a timestamp in bench_ns_per_tick units - the time stamp counter where there is one, it resolves single heap operations
+uint64 bench_now()
+{
+#if TMR_HAVE_X86_SIMD
+	return __rdtsc();
+#else
+	return port_clock();
+#endif
+}
+
+// This function measures bench_ns_per_tick against the port clock, spinning for 50ms
+void bench_calibrate()
+{
+	uint64 freq = port_clock_freq();
+	uint64 start = port_clock();
+	uint64 end;
+	uint64 ticks_start = bench_now();
+	do {
+		end = port_clock();
+	} while ((end - start) * 20 < freq);
+	uint64 ticks = bench_now() - ticks_start;
+	bench_ns_per_tick = (double)(end - start) * 1e9 / (double)freq / (double)ticks;
+}
+
+// Returns a timer interval of the workload
+uint32 bench_interval(bench_workload_t workload)
+{
+	switch (workload) {
+	case BENCH_UNIFORM:
+		return 1 + bench_rand() % BENCH_SPREAD_US;
+	case BENCH_BURSTY:
+		return (1 + bench_rand() % 16) * (BENCH_SPREAD_US / 16) + bench_rand() % 64;
+	default:
+		return BENCH_SPREAD_US;
+	}
+}
+
+// This function sets timers [0, timers_num) with the workload's intervals from the current timer value, the way timer_interrupt would arm them
+void bench_fill(uint32 timers_num, bench_workload_t workload)
+{
+	for (timer_id_t i = 0; i < timers_num; i++)
+		arm_timer(i, bench_interval(workload), 0, TMR_MODE_PERIODIC, tmr_val_reg, bench_count_fire, NULL);
+	program_timer_interrupts();
+}
+
+// This function deactivates timers [0, timers_num)
+void bench_clear(uint32 timers_num)
+{
+	for (timer_id_t i = 0; i < timers_num; i++)
+		disarm_timer(i);
+	program_timer_interrupts();
+}
+
+int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// This function prints the throughput and latency percentiles of the ops_num operations in bench_op_ns, which handled items_num items
+void bench_report(uint32 timers_num, bench_workload_t workload, const char* op, uint32 ops_num, uint64 items_num)
+{
+	double total_ns = 0;
+	for (uint32 i = 0; i < ops_num; i++)
+		total_ns += bench_op_ns[i];
+	qsort(bench_op_ns, ops_num, sizeof(bench_op_ns[0]), compare_double);
+	printf("%-6s %8u %-8s %-7s %10.3f %10.0f %10.0f %10.0f %10.0f\n", bench_backend_names[TMR_BACKEND], timers_num,
+		bench_workload_names[workload], op, (double)items_num * 1e3 / total_ns, bench_op_ns[ops_num / 2],
+		bench_op_ns[ops_num * 99 / 100], bench_op_ns[ops_num * 999 / 1000], bench_op_ns[ops_num - 1]);
+}
+
+/* This function measures the three hot paths with timers_num timers set:
+* arm - set_timer_cb on a set timer plus the timer_interrupt that applies it, at a fixed timer value
+* cancel - remove_timer plus its timer_interrupt, then set_timer_cb on the same timer plus its timer_interrupt,
+*   timed together so the cost a cancelled entry leaves behind for the next arm is measured with it
+* expire - timer_interrupt at each next compare value, throughput counted in fired timers
+*/
+void bench_run(uint32 timers_num, bench_workload_t workload)
+{
+	bench_fill(timers_num, workload);
+
+	for (uint32 op = 0; op < BENCH_OPS; op++) {
+		timer_id_t timer_id = bench_rand() % timers_num;
+		uint32 wait_us = bench_interval(workload);
+		uint64 start = bench_now();
+		set_timer_cb(timer_id, wait_us, bench_count_fire, NULL);
+		timer_interrupt();
+		bench_op_ns[op] = (double)(bench_now() - start) * bench_ns_per_tick;
+	}
+	bench_report(timers_num, workload, "arm", BENCH_OPS, BENCH_OPS);
+
+	for (uint32 op = 0; op < BENCH_OPS; op++) {
+		timer_id_t timer_id = bench_rand() % timers_num;
+		uint32 wait_us = bench_interval(workload);
+		uint64 start = bench_now();
+		remove_timer(timer_id);
+		timer_interrupt();
+		set_timer_cb(timer_id, wait_us, bench_count_fire, NULL);
+		timer_interrupt();
+		bench_op_ns[op] = (double)(bench_now() - start) * bench_ns_per_tick;
+	}
+	bench_report(timers_num, workload, "cancel", BENCH_OPS, BENCH_OPS);
+
+	// Expire until BENCH_OPS interrupts ran, or every timer fired twice when they come in large batches
+	uint32 irqs_num = 0;
+	uint64 fired_num = 0;
+	while (irqs_num < BENCH_OPS && fired_num < 2 * (uint64)timers_num + BENCH_OPS) {
+		uint64 fired_before = bench_fired;
+		tmr_val_reg = tmr_channels[0].cmp_reg;
+		uint64 start = bench_now();
+		timer_interrupt();
+		bench_op_ns[irqs_num++] = (double)(bench_now() - start) * bench_ns_per_tick;
+		fired_num += bench_fired - fired_before;
+	}
+	bench_report(timers_num, workload, "expire", irqs_num, fired_num);
+
+	bench_clear(timers_num);
+}
+
+int main() {
+
+	queue_init();
+	bench_calibrate();
+	tmr_val_reg = 0xfff00000; // The timer value wraps around during the run
+	timer_interrupt(); // The first interrupt takes the time base from the timer value, before any timer is armed
+
+	printf("%-6s %8s %-8s %-7s %10s %10s %10s %10s %10s\n", "queue", "timers", "workload", "op", "Mitems/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+	for (int c = 0; c < (int)(sizeof(bench_counts) / sizeof(bench_counts[0])); c++) {
+		if (bench_counts[c] > TMR_NUM)
+			continue;
+		for (int workload = 0; workload < BENCH_WORKLOADS; workload++)
+			bench_run(bench_counts[c], (bench_workload_t)workload);
+	}
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+SW Timer embeddable engine test.
+Checks TimerEngine (SW_Timer_engine.h) against a model of when each timer is due, for both queues and 8, 16 and
+32-bit counters, including engines whose first timer is set with the counter in the upper half of its range,
+intervals of days on a 64-bit counter, and the C functions of SW_TIMER_DEFINE_C_API. Prints a line per check and
+returns non-zero if any failed:
+cl /nologo /O2 /EHsc SW_Timer_engine_test.cpp && SW_Timer_engine_test.exe
+(g++ -O2 -std=c++14 SW_Timer_engine_test.cpp on POSIX)
+*/
+
+#include "SW_Timer_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+SW_TIMER_DEFINE_C_API(test_timers, 4, 1000000, uint16_t, sw_timer::Backend::Heap)
+
+#define TEST_MAX_TIMERS 64
+#define TEST_STEPS 200000
+
+// The model of a timer - when it is due in 64-bit ticks, and what its fires did
+struct test_model_t {
+	bool active;
+	bool one_shot;
+	uint64_t wait;
+	uint64_t due;
+	uint32_t fires;
+};
+
+test_model_t test_model[TEST_MAX_TIMERS];
+uint64_t test_now = 0; // The test's 64-bit time, the engine's counter is its low bits
+uint32_t test_wrong_fires = 0; // Fires of inactive timers or not exactly at their due time
+uint32_t test_failed = 0;
+
+// Callback of every tested timer - checks the fire against the model, and moves the model to the next period
+void test_fire(uint32_t timer_id, void*)
+{
+	test_model_t* p_model = &test_model[timer_id];
+	if (!p_model->active || p_model->due != test_now)
+		test_wrong_fires++;
+	p_model->fires++;
+	if (p_model->one_shot)
+		p_model->active = false;
+	else
+		p_model->due += p_model->wait;
+}
+
+// Prints the result of a check and counts the failed ones
+void test_report(const char* name, bool passed)
+{
+	printf("%-48s %s\n", name, passed ? "OK" : "FAILED");
+	if (!passed)
+		test_failed++;
+}
+
+/* This function sets, removes and fires timers at random on an engine whose counter starts at start, always moving
+* to the compare value the engine asked for, so every fire must happen exactly at its due time
+*/
+template <class Engine>
+void test_model_run(const char* name, uint64_t start)
+{
+	static Engine engine; // Zero-initialized, like a global engine
+	engine = Engine();
+	typedef typename Engine::counter_t counter_t;
+	uint64_t max_wait = Engine::max_cmp_distance < 300 ? Engine::max_cmp_distance : 300;
+	for (uint32_t i = 0; i < Engine::capacity; i++)
+		test_model[i] = test_model_t();
+	test_now = start;
+	test_wrong_fires = 0;
+	srand(7);
+
+	counter_t cmp = 0;
+	bool armed = false; // No interrupt ran yet, cmp is not set
+	uint32_t set_fails = 0;
+	for (uint32_t step = 0; step < TEST_STEPS; step++) {
+		uint32_t r = (uint32_t)rand() % 20;
+		uint32_t timer_id = (uint32_t)rand() % Engine::capacity;
+		if (r == 0 || !armed) {
+			uint64_t wait = 1 + (uint64_t)rand() % max_wait;
+			bool one_shot = (rand() & 1) != 0;
+			bool set = one_shot ? engine.set_timer_once(timer_id, (counter_t)test_now, Engine::ticks_to_us(wait), test_fire, NULL) :
+				engine.set_timer_ticks(timer_id, (counter_t)test_now, wait, test_fire, NULL);
+			if (!set)
+				set_fails++;
+			test_model_t model = { true, one_shot, wait, test_now + wait, 0 };
+			test_model[timer_id] = model;
+		}
+		else if (r == 1) {
+			engine.remove_timer(timer_id);
+			test_model[timer_id].active = false;
+		}
+		else
+			test_now += (counter_t)(cmp - (counter_t)test_now); // To the next interrupt
+		cmp = engine.interrupt((counter_t)test_now);
+		armed = true;
+	}
+
+	uint32_t missed = 0;
+	for (uint32_t i = 0; i < Engine::capacity; i++) {
+		if (test_model[i].active && test_model[i].due < test_now)
+			missed++;
+	}
+	test_report(name, test_wrong_fires == 0 && missed == 0 && set_fails == 0);
+}
+
+// The first timer of a zero-initialized engine is set with the counter far from 0, it must fire one interval later
+template <class Engine>
+void test_first_arm(const char* name, typename Engine::counter_t now)
+{
+	static Engine engine;
+	engine = Engine();
+	typedef typename Engine::counter_t counter_t;
+	test_model[0] = test_model_t();
+	test_wrong_fires = 0;
+
+	const uint64_t wait = 100;
+	test_model_t model = { true, false, wait, (uint64_t)now + wait, 0 };
+	test_model[0] = model;
+	test_now = now;
+	bool set = engine.set_timer_ticks(0, now, wait, test_fire, NULL);
+	counter_t cmp = engine.interrupt(now);
+	bool due_later = cmp == (counter_t)(now + wait) && test_model[0].fires == 0;
+	for (uint32_t i = 0; i < 200; i++) {
+		test_now += (counter_t)(cmp - (counter_t)test_now);
+		cmp = engine.interrupt((counter_t)test_now);
+	}
+	test_report(name, set && due_later && test_wrong_fires == 0 && test_model[0].fires == 200 && engine.overruns(0) == 0);
+}
+
+/* Intervals of days on a 64-bit counter - us * TickHz is beyond 64 bits at 1 GHz, the timers must still fire exactly
+* that many ticks later - and an interval over a 32-bit counter's range whose tick count would wrap to 1 is rejected
+*/
+void test_long_intervals()
+{
+	typedef sw_timer::TimerEngine<4, 1000000000, uint64_t, sw_timer::Backend::Heap> ghz_engine_t;
+	static ghz_engine_t ghz_engine;
+	ghz_engine = ghz_engine_t();
+	const uint64_t days3_us = 3ULL * 24 * 3600 * 1000000;
+	const uint64_t start = 12345;
+	bool set = ghz_engine.set_timer(0, start, days3_us, NULL, NULL) && ghz_engine.set_timer_once(1, start, 2 * days3_us, NULL, NULL);
+	uint64_t cmp = ghz_engine.interrupt(start);
+	bool first_due = cmp == start + days3_us * 1000;
+	cmp = ghz_engine.interrupt(cmp);
+	bool periodic_fired = ghz_engine.times_fired(0) == 1 && cmp == start + 2 * days3_us * 1000;
+	ghz_engine.interrupt(cmp);
+	bool one_shot_fired = ghz_engine.times_fired(1) == 1 && !ghz_engine.is_active(1);
+	test_report("64-bit counter at 1 GHz, 3 and 6 day intervals", set && first_due && periodic_fired && one_shot_fired);
+
+	typedef sw_timer::TimerEngine<4, 1000000, uint64_t, sw_timer::Backend::Flat> us_engine_t;
+	static us_engine_t us_engine;
+	us_engine = us_engine_t();
+	set = us_engine.set_timer_once(0, 0, 20000000000000ULL, NULL, NULL);
+	test_report("64-bit counter, 2e13 us one-shot", set && us_engine.interrupt(0) == 20000000000000ULL &&
+		us_engine_t::ticks_to_us(20000000000000ULL) == 20000000000000ULL);
+
+	static sw_timer::TimerEngine<4, 1000000, uint32_t> short_engine;
+	test_report("32-bit counter, us overflowing 64-bit ticks",
+		!short_engine.set_timer(0, 0, 18446744073710ULL, NULL, NULL) && !short_engine.set_timer_once(0, 0, UINT64_MAX, NULL, NULL));
+}
+
+// The C functions of a fixed engine, first set with the counter in its upper half
+void test_c_api()
+{
+	test_model[1] = test_model_t();
+	test_model_t model = { true, false, 2000, 65000ULL + 2000, 0 };
+	test_model[1] = model;
+	test_wrong_fires = 0;
+	test_now = 65000;
+	bool set = test_timers_set_timer(1, 65000, 2000, test_fire, NULL) != 0;
+	uint16_t cmp = test_timers_interrupt(65000);
+	for (uint32_t i = 0; i < 100; i++) {
+		test_now += (uint16_t)(cmp - (uint16_t)test_now);
+		cmp = test_timers_interrupt((uint16_t)test_now);
+	}
+	test_report("C API, first set at 65000", set && test_wrong_fires == 0 && test_timers_times_fired(1) == 100 &&
+		test_timers_is_active(1) != 0 && test_timers_remove_timer(1) != 0 && test_timers_is_active(1) == 0);
+}
+
+int main()
+{
+	static_assert(sw_timer::TimerEngine<4, 32768>::us_to_ticks(1000) == 33, "us_to_ticks must round up and fold at compile time");
+
+	test_model_run<sw_timer::TimerEngine<64, 1000000, uint32_t, sw_timer::Backend::Heap> >("heap, 32-bit counter", 0);
+	test_model_run<sw_timer::TimerEngine<64, 1000000, uint32_t, sw_timer::Backend::Flat> >("flat, 32-bit counter", 0xfff00000ULL);
+	test_model_run<sw_timer::TimerEngine<64, 1000000, uint16_t, sw_timer::Backend::Heap> >("heap, 16-bit counter from 65000", 65000);
+	test_model_run<sw_timer::TimerEngine<50, 1000000, uint16_t, sw_timer::Backend::Flat> >("flat, 16-bit counter from 40000", 40000);
+	test_model_run<sw_timer::TimerEngine<64, 1000000, uint8_t, sw_timer::Backend::Heap> >("heap, 8-bit counter from 200", 200);
+	test_model_run<sw_timer::TimerEngine<10, 1000000, uint8_t, sw_timer::Backend::Flat> >("flat, 8-bit counter from 130", 130);
+
+	test_first_arm<sw_timer::TimerEngine<4, 1000000, uint16_t, sw_timer::Backend::Heap> >("heap, 16-bit counter, first set at 65000", 65000);
+	test_first_arm<sw_timer::TimerEngine<4, 1000000, uint16_t, sw_timer::Backend::Flat> >("flat, 16-bit counter, first set at 65000", 65000);
+	test_first_arm<sw_timer::TimerEngine<4, 1000000, uint32_t, sw_timer::Backend::Heap> >("heap, 32-bit counter, first set at 0xf0000000", 0xf0000000u);
+	test_first_arm<sw_timer::TimerEngine<4, 1000000, uint8_t, sw_timer::Backend::Flat> >("flat, 8-bit counter, first set at 250", 250);
+	test_long_intervals();
+	test_c_api();
+
+	printf("%u checks failed\n", test_failed);
+	return test_failed != 0;
+}
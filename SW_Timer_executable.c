@@ -1,224 +1,3017 @@
 /*
 SW Timer implementation.
-The implementataion allows scheduling up to 10 simultaneous SW timer instances, based on a single HW timer module.
+The implementataion allows scheduling up to TMR_NUM (10 by default) simultaneous SW timer instances, based on a single HW timer module.
 The HW timer is connected to the CPU data bus, and its registers are mapped to the addresses defined below.
 The HW timer is implemented by a free running 32-bit counter block, counting up at frequency of 1MHz.
+The platform is reached through the port layer of SW_Timer_port.h - on hosted ports the HW timer and its interrupts
+are simulated by threads, on bare metal the registers are the real ones at TMR_REGS_BASE.
 */
 
-#include <windows.h>
+#include "SW_Timer_port.h" // First - a port may need feature macros set before any system header
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
 
+#ifndef TMR_NUM
 #define TMR_NUM 10
+#endif
+
+// Timer queue backends, select one at build time with TMR_BACKEND
+#define TMR_BACKEND_FLAT 0 // Linear scan over the timer state arrays - O(N) per set/interrupt
+#define TMR_BACKEND_HEAP 1 // Binary min-heap keyed on absolute expiry tick - O(1) peek, O(log N) update
+#define TMR_BACKEND_WHEEL 2 // Hierarchical timing wheel - O(1) set/remove, amortized O(1) expiry
+#ifndef TMR_BACKEND
+#define TMR_BACKEND TMR_BACKEND_HEAP
+#endif
+
+// With only a few timers the wheel's bookkeeping costs more than scanning them, use the flat array instead
+#ifndef TMR_WHEEL_MIN_NUM
+#define TMR_WHEEL_MIN_NUM 64
+#endif
+#if TMR_BACKEND == TMR_BACKEND_WHEEL && TMR_NUM < TMR_WHEEL_MIN_NUM
+#undef TMR_BACKEND
+#define TMR_BACKEND TMR_BACKEND_FLAT
+#endif
+
+// Lazy cancellation (heap backend) - removed timers stay in the heap as tombstones, swept out once they are
+// TMR_TOMBSTONE_PERCENT of it, TMR_TOMBSTONE_SWEEP heap entries per interrupt
+#ifndef TMR_LAZY_CANCEL
+#define TMR_LAZY_CANCEL 1
+#endif
+#ifndef TMR_TOMBSTONE_PERCENT
+#define TMR_TOMBSTONE_PERCENT 25
+#endif
+#ifndef TMR_TOMBSTONE_SWEEP
+#define TMR_TOMBSTONE_SWEEP 64
+#endif
+
+// Sharded mode - the timer IDs are split into TMR_SHARDS contiguous ranges, each with its own timer queue
+// and command ring, meant for one producer thread per CPU core. See timer_shard_t.
+#ifndef TMR_SHARDS
+#define TMR_SHARDS 1
+#endif
+#if TMR_SHARDS > 64
+#error TMR_SHARDS is limited to 64, the shards needing a new next deadline are tracked in one 64-bit word
+#endif
+#if TMR_SHARDS > 1 && TMR_NUM < TMR_SHARDS * 64
+#error Sharded mode needs at least 64 timers per shard, the shards are whole words of the active bitmap
+#endif
+
+// HW compare channels - channel 0 interrupts for the timer queue, each further channel is dedicated to one of the
+// nearest-deadline timers. See tmr_channels.
+#ifndef TMR_HW_CHANNELS
+#define TMR_HW_CHANNELS 1
+#endif
+#if TMR_HW_CHANNELS > 32
+#error TMR_HW_CHANNELS is limited to 32, the pending interrupt lines are one 32-bit word
+#endif
+
+// Statistics - fire lateness histograms, ISR execution times and queue lengths. Build with TMR_STATS 0 to leave them out.
+#ifndef TMR_STATS
+#define TMR_STATS 1
+#endif
+
+// Trace - records every applied timer command and every fire for SW_Timer_replay.c, see trace_save
+#ifndef TMR_TRACE
+#define TMR_TRACE 0
+#endif
+#ifndef TMR_TRACE_RECORDS
+#define TMR_TRACE_RECORDS (1 << 20) // Records the trace buffer holds (16 bytes each), later ones are dropped
+#endif
+#if TMR_TRACE && TMR_NUM > (1 << 28)
+#error "Trace records hold 28-bit timer IDs, TMR_NUM must not exceed 1 << 28"
+#endif
+
+// Deferred expiry - the timer interrupt only reloads the fired timers, their callbacks and statistics run on
+// TMR_BH_WORKERS bottom-half workers (0 runs them in the interrupt), see timer_bh_run
+#ifndef TMR_BH_WORKERS
+#define TMR_BH_WORKERS 0
+#endif
+#ifndef TMR_BH_QUEUE_SIZE
+#define TMR_BH_QUEUE_SIZE 1024 // Capacity of each worker's fire ring, must be a power of 2
+#endif
+#ifndef TMR_ISR_FIRE_CAP
+#define TMR_ISR_FIRE_CAP TMR_NUM // Most queued timers one interrupt fires, the interrupt it raises fires the rest
+#endif
+#if TMR_BH_QUEUE_SIZE < 1 || (TMR_BH_QUEUE_SIZE & (TMR_BH_QUEUE_SIZE - 1)) != 0
+#error "TMR_BH_QUEUE_SIZE must be a power of 2, the fire rings are indexed with a mask"
+#endif
+#if TMR_BH_WORKERS > 0 && TMR_BH_QUEUE_SIZE < TMR_HW_CHANNELS
+#error "TMR_BH_QUEUE_SIZE must hold the fires of all HW channels"
+#endif
+#if TMR_ISR_FIRE_CAP < 1
+#error "TMR_ISR_FIRE_CAP must let an interrupt fire at least one timer"
+#endif
+
+#define TMR_SHARD_WORDS ((TMR_NUM + TMR_SHARDS * 64 - 1) / (TMR_SHARDS * 64)) // 64-bit words of the active bitmap per shard
+#define TMR_SHARD_TIMERS (TMR_SHARD_WORDS * 64) // Shard s owns timer IDs [s * TMR_SHARD_TIMERS, (s + 1) * TMR_SHARD_TIMERS)
+#define TMR_ACTIVE_WORDS (TMR_SHARDS * TMR_SHARD_WORDS) // 64-bit words of the active timers bitmap
+#define TMR_NUM_PADDED (TMR_ACTIVE_WORDS * 64)
+#define TMR_SUMMARY_WORDS ((TMR_SHARD_WORDS + 63) / 64) // 64-bit words of a shard's bitmap summary, one bit per bitmap word
+#define TIMER_SHARD(timer_id) ((timer_id) / TMR_SHARD_TIMERS)
+#define TIMER_IS_ACTIVE(timer_id) ((timer_active[(timer_id) / 64] >> ((timer_id) % 64)) & 1)
+#define TMR_INVALID_ID 0xffffffff // No timer
+#define TMR_INVALID_HANDLE 0 // Never returned by sw_timer_create, generations start at 1
+
+#define TMR_HEAP_NONE 0xffffffff // heap_pos of a timer that is not queued
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS) // Slots per wheel level, one bit each in the level's occupancy word
+#define WHEEL_LEVELS 11 // 11 levels of 6 bits cover the whole 64-bit extended timer value
+#define WHEEL_NIL 0xffffffff // Empty slot list / timer that is not queued
+#define TMR_FREQ_HZ 1000000 // HW timer counting frequency
+#define TMR_MAX_CMP_DISTANCE 0x7fffffff // A compare value further ahead would look like one that already passed
+#define TMR_CACHE_LINE 64
+#define TMR_PAGE_SIZE 4096 // The unit the OS places on a NUMA node
+#ifndef TMR_PAD_HOT_STATE
+#define TMR_PAD_HOT_STATE 1 // 0 packs the hot state like the original globals, for SW_Timer_sharing_bench.c to compare
+#endif
+
+// HW timer simulation modes, select one at build time with TMR_SIM_CLOCK
+#define TMR_SIM_CLOCK_STEP 0 // tmr_val_reg counts one tick per loop iteration - the rate depends on the scheduler
+#define TMR_SIM_CLOCK_QPC 1 // tmr_val_reg follows the port clock (QueryPerformanceCounter on Win32), ticks missed while preempted are caught up
+#define TMR_SIM_CLOCK_TICKLESS 2 // Like QPC, but the thread sleeps until the compare value is due instead of spinning
+#define TMR_SIM_CLOCK_EVENT_LOOP 3 // Like QPC, without threads - a timerfd polled by the application's epoll loop, which runs the ISRs inline
+#ifndef TMR_SIM_CLOCK
+#define TMR_SIM_CLOCK TMR_SIM_CLOCK_TICKLESS
+#endif
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP && !TMR_PORT_HAS_TIMERFD
+#error "TMR_SIM_CLOCK_EVENT_LOOP needs a port with timerfd (POSIX on Linux)"
+#endif
+
+// The bottom-half workers are threads where the simulation runs on threads too, otherwise the application's main loop
+#define TMR_BH_THREADS (TMR_BH_WORKERS > 0 && TMR_PORT_HOSTED && TMR_SIM_CLOCK != TMR_SIM_CLOCK_EVENT_LOOP)
+
+// Simulation hook for writes to the HW timer registers - wakes the tickless HW thread to recompute its sleep,
+// or re-arms the event loop's timerfd
+#if TMR_PORT_HOSTED && TMR_SIM_CLOCK == TMR_SIM_CLOCK_TICKLESS
+#define HW_TIMER_REG_WRITTEN() port_event_signal(&hw_wake_event)
+#elif TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+void timer_event_loop_arm();
+void timer_event_loop_dispatch();
+#define HW_TIMER_REG_WRITTEN() timer_event_loop_arm()
+#else
+#define HW_TIMER_REG_WRITTEN()
+#endif
+#define TMR_CMD_QUEUE_SIZE 256 // Capacity of the arm/cancel command ring, must be a power of 2
 #define MAX_INPUT_LENGTH 256
+#define TMR_SNAPSHOT_RETRIES 100 // Copies timer_snapshot tries before giving up on the ISRs ever leaving the state alone
+#define TMR_NO_DEADLINE 0xffffffffffffffffULL // timer_aggregate_t next_deadline64 with no timer active
+#define TMR_SCRIPT_CHUNK_SIZE (64 * 1024) // Script input is read in chunks of this many bytes, a line must fit one
+#define TMR_SCRIPT_OUTPUT_SIZE (1024 * 1024) // stdout buffer of script mode, the output is written in blocks of it
+#define TMR_SCRIPT_BATCH TMR_CMD_QUEUE_SIZE // set lines applied by one set_timers_batch call at most
 #define STRINGS_ARE_EQUAL( Str1, Str2 ) ( strcmp( (Str1), (Str2) ) == 0 )
 
-typedef unsigned int uint32;
-typedef unsigned char uint8;
+typedef unsigned long long uint64;
+typedef unsigned int uint32;
+typedef int int32;
+typedef unsigned char uint8;
+typedef uint32 timer_id_t; // Index of a timer in the timer state arrays
+typedef void (*timer_cb_t)(timer_id_t timer_id, void* ctx); // Called in interrupt context every time a timer fires
+typedef uint64 timer_handle_t; // Generation in the high 32 bits, timer ID in the low 32 bits
+typedef uint64 timer_summary_t[TMR_SUMMARY_WORDS]; // A shard's summary of a timer bitmap
+
+// Bit scan helpers - index of the lowest / highest set bit, x must not be 0
+#if defined(_MSC_VER)
+#include <intrin.h>
+static __inline uint32 bit_scan_forward64(uint64 x) { unsigned long i; _BitScanForward64(&i, x); return i; }
+static __inline uint32 bit_scan_reverse64(uint64 x) { unsigned long i; _BitScanReverse64(&i, x); return i; }
+#else
+static inline uint32 bit_scan_forward64(uint64 x) { return (uint32)__builtin_ctzll(x); }
+static inline uint32 bit_scan_reverse64(uint64 x) { return 63 - (uint32)__builtin_clzll(x); }
+#endif
+
+// Per-thread and cache line alignment attributes - bare metal has a single set_timer thread
+#if !TMR_PORT_HOSTED
+#define TMR_THREAD_LOCAL
+#define TMR_CACHE_ALIGNED __attribute__((aligned(TMR_CACHE_LINE)))
+#elif defined(_MSC_VER)
+#define TMR_THREAD_LOCAL __declspec(thread)
+#define TMR_CACHE_ALIGNED __declspec(align(TMR_CACHE_LINE))
+#else
+#define TMR_THREAD_LOCAL __thread
+#define TMR_CACHE_ALIGNED __attribute__((aligned(TMR_CACHE_LINE)))
+#endif
+#if defined(_MSC_VER)
+#define TMR_PAGE_ALIGNED __declspec(align(TMR_PAGE_SIZE))
+#else
+#define TMR_PAGE_ALIGNED __attribute__((aligned(TMR_PAGE_SIZE)))
+#endif
+
+// State written by one thread every tick or interrupt gets a cache line of its own, away from what other threads write
+#if TMR_PAD_HOT_STATE
+#define TMR_HOT_ALIGNED TMR_CACHE_ALIGNED
+#else
+#define TMR_HOT_ALIGNED
+#endif
+
+// x86 SIMD kernels are compiled in regardless of the build's target flags and picked at runtime
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TMR_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define TMR_TARGET(isa)
+#else
+#define TMR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#else
+#define TMR_HAVE_X86_SIMD 0
+#endif
+
+// Callback of a timer, kept apart from the timer state scanned by the queue
+typedef struct {
+	timer_cb_t cb; // Called when the timer fires, NULL for none
+	void* cb_ctx; // Passed to cb
+} timer_callback_t;
+
+#if TMR_BACKEND == TMR_BACKEND_WHEEL
+// Wheel links of a timer, the fields are always used together
+typedef struct {
+	uint64 expiry; // deadline extended to 64 bits, relative to wheel_time
+	timer_id_t next; // Next timer in the same wheel slot
+	timer_id_t prev; // Previous timer in the same wheel slot
+	uint32 slot; // level * WHEEL_SLOTS + slot of the timer, WHEEL_NIL if not queued
+} wheel_node_t;
+#endif
+
+// Commands passed from set_timer/remove_timer to timer_interrupt
+typedef enum {
+	TMR_CMD_SET,
+	TMR_CMD_SET_AT, // Like TMR_CMD_SET, with start + wait_us an absolute deadline to keep
+	TMR_CMD_SET_LONG, // Like TMR_CMD_SET_AT, with the interval in long_wait_us
+	TMR_CMD_REMOVE
+} timer_cmd_type_t;
+
+// Kinds of trace records
+typedef enum {
+	TMR_TRACE_SET, // set_timer_slack - a periodic timer
+	TMR_TRACE_SET_ONCE, // set_timer_once
+	TMR_TRACE_SET_AT, // set_timer_at, at time + wait_us
+	TMR_TRACE_SET_LONG, // set_timer_long, the interval in wait_us (low 32 bits) and slack_us (high 32 bits)
+	TMR_TRACE_SET_AT64, // set_timer_at64, that much after time
+	TMR_TRACE_REMOVE, // remove_timer
+	TMR_TRACE_FIRE // A fire, time is the timer value of the interrupt
+} trace_type_t;
+
+// One record of a trace, 16 bytes
+typedef struct {
+	uint32 time; // The timer value the command was given at, or of the fire
+	uint32 type_id; // trace_type_t in the high 4 bits, the timer ID in the low 28
+	uint32 wait_us;
+	uint32 slack_us;
+} trace_record_t;
+
+// The header of a trace file, followed by records_num records in the byte order of the recording machine
+typedef struct {
+	char magic[4]; // "SWTT"
+	uint32 version; // 1
+	uint32 freq_hz; // TMR_FREQ_HZ of the recording
+	uint32 records_num;
+} trace_header_t;
+
+#define TRACE_TYPE_SHIFT 28
+#define TRACE_ID_MASK ((1u << TRACE_TYPE_SHIFT) - 1)
+
+// What a timer does when it fires
+typedef enum {
+	TMR_MODE_PERIODIC, // Reloaded one interval later
+	TMR_MODE_ONE_SHOT // Deactivated, before its callback runs
+} timer_mode_t;
+
+typedef struct {
+	uint32 type; // timer_cmd_type_t
+	timer_id_t timer_id;
+	uint32 wait_us; // TMR_CMD_SET only - the interval of the timer
+	uint32 slack_us; // TMR_CMD_SET only - how much later than the interval the timer may fire
+	uint32 start; // The timer value set_timer or remove_timer was called at
+	uint32 mode; // TMR_CMD_SET only - timer_mode_t
+	timer_cb_t cb; // TMR_CMD_SET only - the callback of the timer
+	void* cb_ctx; // TMR_CMD_SET only - passed to cb
+	uint64 long_wait_us; // TMR_CMD_SET_LONG only - the interval of a long timer
+} timer_cmd_t;
+
+// One timer of a set_timers_batch call, the arguments of set_timer_slack
+typedef struct {
+	timer_id_t timer_id;
+	uint32 wait_us;
+	uint32 slack_us;
+	timer_cb_t cb; // NULL for none
+	void* cb_ctx; // Passed to cb
+} timer_req_t;
+
+// Registers of one HW timer compare channel, all channels compare against tmr_val_reg
+typedef struct {
+	volatile uint32 cmp_reg; // Write-Only register - uint32 channel interrupt compare value
+	volatile uint32 en_reg; // Write-Only register - non-zero enables the channel's compare interrupt
+	volatile uint32 clr_reg; // Write-Only uint32 register - write any value to clear the channel's interrupt
+} hw_timer_channel_t;
+
+#ifdef TMR_REGS_BASE
+// Register map of the HW timer - the value and software interrupt registers, then the channels
+#define tmr_val_reg (*(volatile uint32*)(TMR_REGS_BASE)) // Read-Only register - current uint32 timer value
+#define tmr_swi_reg (*(volatile uint32*)(TMR_REGS_BASE + 4)) // Write-Only uint32 register - write any value to raise channel 0's interrupt by software
+#define tmr_channels ((hw_timer_channel_t*)(TMR_REGS_BASE + 8)) // Channel 0 (enabled at reset) interrupts timer_interrupt, the others timer_channel_interrupt
+#else
+/* The simulated registers and interrupt lines. Different threads write each of them - the hw timer thread the value
+* register on every tick, the set_timer threads the software interrupt register, the ISR the channels, and the hw timer
+* and ISR threads the interrupt lines - so each has a cache line of its own, and the ticks don't take away the lines
+* the set_timer and ISR threads work on.
+*/
+typedef struct {
+	TMR_HOT_ALIGNED volatile uint32 val_reg;
+	TMR_HOT_ALIGNED volatile uint32 swi_reg;
+	TMR_HOT_ALIGNED hw_timer_channel_t channels[TMR_HW_CHANNELS];
+	TMR_HOT_ALIGNED volatile uint32 irq_lines; // Bit c is set while channel c's interrupt waits for the ISR thread
+} hw_timer_regs_t;
+
+TMR_HOT_ALIGNED hw_timer_regs_t hw_timer_regs = { 0, 0, { { 0, 1, 0 } }, 0 };
+#define tmr_val_reg (hw_timer_regs.val_reg) // Read-Only register - current uint32 timer value
+#define tmr_swi_reg (hw_timer_regs.swi_reg) // Write-Only uint32 register - write any value to raise channel 0's interrupt by software
+#define tmr_channels (hw_timer_regs.channels) // Channel 0 (always enabled) interrupts timer_interrupt, the others timer_channel_interrupt
+#define hw_irq_lines (hw_timer_regs.irq_lines)
+#endif
+#if TMR_PORT_HOSTED
+port_thread_t h_hw_timer; // hw timer thread
+port_thread_t h_isr; // isr thread
+port_event_t irq_event; // Auto-reset event the hw timer thread signals to raise the interrupt
+port_event_t hw_wake_event; // Auto-reset event signaled on HW timer register writes, the tickless hw timer thread sleeps on it until the compare value
+#endif
+BOOL g_no_errors = TRUE; // Indicates an error that leads to finishing the program
+
+/* Timer state, as a struct of arrays - the queue scans only pull in the deadlines and the active bitmap,
+* while statistics and callbacks live in their own arrays. Inactive entries have wait_us==0 and a clear active bit.
+* The arrays are padded to whole 64-timer blocks of the bitmap, the padding entries are never active.
+*/
+uint32 timer_deadline[TMR_NUM_PADDED] = { 0 }; // The absolute timer value of the next interrupt
+uint32 timer_wait_us[TMR_NUM_PADDED] = { 0 }; // The constant time interval of the timer
+uint32 timer_slack_us[TMR_NUM_PADDED] = { 0 }; // The timer may fire up to slack_us before its deadline
+uint64 timer_active[TMR_ACTIVE_WORDS] = { 0 }; // Bit (id % 64) of word (id / 64) is set when the timer is active
+timer_summary_t timer_active_summary[TMR_SHARDS] = { 0 }; // Bit w of a shard is set when the shard's bitmap word w is non-zero
+uint32 timer_times_fired[TMR_NUM] = { 0 }; // The number of times the timer fired since it was armed
+uint8 timer_mode[TMR_NUM] = { 0 }; // timer_mode_t of the timer
+uint32 timer_overruns[TMR_NUM] = { 0 }; // Periods a late periodic timer skipped instead of firing them back to back
+uint64 timer_long_wait_us[TMR_NUM] = { 0 }; // The interval of a long timer (timer_wait_us is saturated), 0 for the others
+uint64 timer_expiry64[TMR_NUM] = { 0 }; // The deadline of a long timer extended to 64 bits, see last_update_time64
+timer_callback_t timer_callbacks[TMR_NUM] = { 0 };
+uint32 last_update_timer_value = 0; /*The timer value of the last time the timer state was updated.
+									Initialized with 0, timer_rebase moves it to the timer value in the first interrupt*/
+
+/* 64-bit timebase - the 32-bit timer value wraps every ~71.6 minutes at 1MHz, last_update_time64 extends
+* last_update_timer_value with the number of wraps so far. timer_interrupt runs at least every TMR_MAX_CMP_DISTANCE
+* ticks, so no wrap goes unnoticed. Its low 32 bits are always last_update_timer_value.
+*/
+uint64 last_update_time64 = 0;
+
+// Extends a 32-bit timer value that is not before last_update_timer_value to 64 bits
+#define TIMER_EXTEND(timer_value) (last_update_time64 + (uint32)((timer_value) - last_update_timer_value))
+timer_id_t timer_expired[TMR_NUM]; // Timers collected by the current timer_interrupt call
+
+/* Deadlines are compared by their distance from last_update_timer_value (serial arithmetic), so the order
+* stays correct when the 32-bit timer value wraps around. Every queued deadline is at or after
+* last_update_timer_value, and a timer is due once its key is not above current value - last_update_timer_value.
+*/
+#define DEADLINE_KEY(timer_id) (timer_deadline[(timer_id)] - last_update_timer_value)
+
+/* Slack - timer_deadline is a timer's hard expiry, the latest it may fire, and its soft expiry is slack_us earlier.
+* The queues are ordered and the compare value is set by the hard expiry, while an interrupt fires every timer
+* it finds past its soft expiry, so timers whose windows overlap share one interrupt (like Linux hrtimer slack).
+* A timer is due once its soft expiry is not after the current timer value.
+*/
+#define TIMER_IS_DUE(timer_id, elapsed) ((uint64)DEADLINE_KEY(timer_id) <= (uint64)(elapsed) + timer_slack_us[(timer_id)])
+uint32 timer_interrupts_saved = 0; // Timers fired ahead of their hard expiry by slack, each would have needed an interrupt otherwise
+uint32 timer_slack_num = 0; // Active timers with a non-zero slack, the queues look for soft-due timers only if there are any
+
+/* Timer bitmaps - one bit per timer ID, with a summary per shard that has one bit per non-empty bitmap word.
+* The active timers bitmap is one of them, the flat backend keeps another for the queued timers.
+*/
+// This function sets the bit of a timer and the summary bit of its bitmap word
+void timer_bitmap_set(uint64* bitmap, timer_summary_t* summary, timer_id_t timer_id)
+{
+	uint32 word = timer_id / 64;
+	uint32 shard_word = word % TMR_SHARD_WORDS;
+	bitmap[word] |= 1ULL << (timer_id % 64);
+	summary[TIMER_SHARD(timer_id)][shard_word / 64] |= 1ULL << (shard_word % 64);
+}
+
+// This function clears the bit of a timer, and the summary bit once its bitmap word is empty
+void timer_bitmap_clear(uint64* bitmap, timer_summary_t* summary, timer_id_t timer_id)
+{
+	uint32 word = timer_id / 64;
+	uint32 shard_word = word % TMR_SHARD_WORDS;
+	bitmap[word] &= ~(1ULL << (timer_id % 64));
+	if (bitmap[word] == 0)
+		summary[TIMER_SHARD(timer_id)][shard_word / 64] &= ~(1ULL << (shard_word % 64));
+}
+
+/* This function returns the lowest timer ID set in the bitmap that is not below timer_id, TMR_INVALID_ID if there is none.
+* Empty bitmap words are skipped through the summary, so iterating all set timers with it costs
+* O(set timers + TMR_NUM / 4096) instead of O(TMR_NUM).
+*/
+timer_id_t timer_bitmap_next(const uint64* bitmap, const timer_summary_t* summary, timer_id_t timer_id)
+{
+	if (timer_id >= TMR_NUM)
+		return TMR_INVALID_ID;
+
+	// The rest of the timer's own bitmap word
+	uint32 word = timer_id / 64;
+	uint64 bits = bitmap[word] & (~0ULL << (timer_id % 64));
+	if (bits != 0)
+		return word * 64 + bit_scan_forward64(bits);
+
+	// The next non-empty bitmap word, in this shard or the following ones
+	word++;
+	uint32 shard = word / TMR_SHARD_WORDS;
+	uint32 shard_word = word % TMR_SHARD_WORDS;
+	for (; shard < TMR_SHARDS; shard++, shard_word = 0) {
+		for (uint32 summary_word = shard_word / 64; summary_word < TMR_SUMMARY_WORDS; summary_word++) {
+			uint64 summary_bits = summary[shard][summary_word];
+			if (summary_word == shard_word / 64)
+				summary_bits &= ~0ULL << (shard_word % 64);
+			if (summary_bits == 0)
+				continue;
+			word = shard * TMR_SHARD_WORDS + summary_word * 64 + bit_scan_forward64(summary_bits);
+			return word * 64 + bit_scan_forward64(bitmap[word]);
+		}
+	}
+	return TMR_INVALID_ID;
+}
+
+#define next_active_timer(timer_id) timer_bitmap_next(timer_active, timer_active_summary, (timer_id)) // Lowest active timer ID from timer_id on
+uint32 timer_active_num = 0; // Number of active timers
+
+// This function marks a timer active
+void set_active_bit(timer_id_t timer_id)
+{
+	if (!TIMER_IS_ACTIVE(timer_id))
+		timer_active_num++;
+	timer_bitmap_set(timer_active, timer_active_summary, timer_id);
+}
+
+// This function marks a timer inactive
+void clear_active_bit(timer_id_t timer_id)
+{
+	if (TIMER_IS_ACTIVE(timer_id))
+		timer_active_num--;
+	timer_bitmap_clear(timer_active, timer_active_summary, timer_id);
+}
+
+/* Statistics, written by the ISR thread only and read by display_timer_stats and dump_timer_stats without a lock.
+* With TMR_BH_WORKERS the fire statistics of a timer are written by the worker its fires go to instead, and a maximal
+* lateness two workers raise at once may keep the smaller one.
+* Each counter is a single aligned word, so a reader may see one histogram or ISR counter a fire ahead of another,
+* but never a torn value (the 64-bit ones only on 64-bit targets).
+*/
+#define TMR_LATE_BUCKETS 16 // Bucket 0 counts fires on time, bucket b fires late by [2^(b-1), 2^b) ticks, the last one all later fires
+#define TMR_STATS_WRITERS (TMR_BH_WORKERS > 0 ? TMR_BH_WORKERS : 1) // The ISR, or the bottom-half workers, see timer_late_hist
+#if TMR_LATE_BUCKETS * 8 % TMR_CACHE_LINE != 0
+#error "A lateness histogram must fill whole cache lines, TMR_LATE_BUCKETS * 8 must be a multiple of TMR_CACHE_LINE"
+#endif
+
+// Statistics of one interrupt service routine
+typedef struct {
+	uint64 calls;
+	uint64 clock_total; // Execution time of all calls, in port clock ticks
+	uint64 clock_max;
+	uint64 fired_total; // Timers fired by all calls
+	uint32 fired_max;
+	uint64 active_total; // Sum of timer_active_num over all calls
+	uint32 active_max;
+} isr_stats_t;
+
+isr_stats_t timer_isr_stats = { 0 }; // timer_interrupt
+isr_stats_t channel_isr_stats = { 0 }; // timer_channel_interrupt
+#if TMR_STATS
+// Lateness histogram of all fires since the start, one per writer - worker w counts the fires of the timers it runs,
+// timer_id % TMR_BH_WORKERS == w. Aligned, each writer's histogram is cache lines of its own, and there are a few
+// of them however many timers there are
+TMR_HOT_ALIGNED uint64 timer_late_hist[TMR_STATS_WRITERS][TMR_LATE_BUCKETS];
+uint32 timer_late_max_us[TMR_NUM]; // The latest each timer fired after its hard expiry since it was set, in ticks
+uint32 timer_late_max = 0; // The latest any timer fired after its hard expiry, in ticks
+#endif
+
+// This function returns the lateness histogram bucket of a fire late_us after the hard expiry
+uint32 late_bucket(uint32 late_us)
+{
+	if (late_us == 0)
+		return 0;
+	uint32 bucket = 1 + bit_scan_reverse64(late_us);
+	return bucket < TMR_LATE_BUCKETS ? bucket : TMR_LATE_BUCKETS - 1;
+}
+
+// Returns how late a timer fires at current_timer_value after its hard expiry, before the timer is reloaded
+uint32 timer_late_us(timer_id_t timer_id, uint32 current_timer_value)
+{
+	if (timer_deadline[timer_id] - current_timer_value <= timer_slack_us[timer_id])
+		return 0; // On time, or ahead of its hard expiry by slack
+	return current_timer_value - timer_deadline[timer_id];
+}
+
+// This function counts a fire late_us late in the timer's histogram
+void stats_record_fire(timer_id_t timer_id, uint32 late_us)
+{
+#if TMR_STATS
+	timer_late_hist[timer_id % TMR_STATS_WRITERS][late_bucket(late_us)]++;
+	if (late_us > timer_late_max_us[timer_id])
+		timer_late_max_us[timer_id] = late_us;
+	if (late_us > timer_late_max)
+		timer_late_max = late_us;
+#endif
+}
+
+// This function clears the statistics of a timer that is set again
+void stats_reset_timer(timer_id_t timer_id)
+{
+#if TMR_STATS
+	timer_late_max_us[timer_id] = 0;
+#endif
+}
+
+// This function returns the port clock at the entry of an ISR, for stats_isr_end
+uint64 stats_isr_begin()
+{
+#if TMR_STATS
+	return port_clock();
+#else
+	return 0;
+#endif
+}
+
+// This function counts an ISR call that started at clock_start and fired fired_num timers
+void stats_isr_end(isr_stats_t* p_stats, uint64 clock_start, uint32 fired_num)
+{
+#if TMR_STATS
+	uint64 clock_elapsed = (port_clock() - clock_start) & TMR_PORT_CLOCK_MASK;
+	p_stats->calls++;
+	p_stats->clock_total += clock_elapsed;
+	if (clock_elapsed > p_stats->clock_max)
+		p_stats->clock_max = clock_elapsed;
+	p_stats->fired_total += fired_num;
+	if (fired_num > p_stats->fired_max)
+		p_stats->fired_max = fired_num;
+	p_stats->active_total += timer_active_num;
+	if (timer_active_num > p_stats->active_max)
+		p_stats->active_max = timer_active_num;
+#endif
+}
+
+/* Trace, written by the ISR thread only: the commands at the interrupt that applies them, stamped with the timer value
+* their call read, and the fires. Timers that callbacks arm or disarm directly are not traced.
+*/
+#if TMR_TRACE
+trace_record_t trace_records[TMR_TRACE_RECORDS];
+volatile uint32 trace_records_num = 0;
+uint32 trace_records_dropped = 0; // Records that didn't fit the buffer
+uint32 trace_start_record = 0; // The first record trace_save writes, set by trace_start from the saving thread
+uint32 trace_start_dropped = 0; // trace_records_dropped at trace_start
+#endif
+
+// This function appends a record to the trace
+void trace_record(trace_type_t type, timer_id_t timer_id, uint32 time, uint32 wait_us, uint32 slack_us)
+{
+#if TMR_TRACE
+	uint32 records_num = trace_records_num;
+	if (records_num == TMR_TRACE_RECORDS) {
+		trace_records_dropped++;
+		return;
+	}
+	trace_record_t* p_record = &trace_records[records_num];
+	p_record->time = time;
+	p_record->type_id = ((uint32)type << TRACE_TYPE_SHIFT) | timer_id;
+	p_record->wait_us = wait_us;
+	p_record->slack_us = slack_us;
+	port_memory_barrier(); // The record must be complete before trace_save can see it
+	trace_records_num = records_num + 1;
+#endif
+}
+
+// This function appends a command to the trace
+void trace_record_cmd(const timer_cmd_t* p_cmd)
+{
+#if TMR_TRACE
+	if (p_cmd->type == TMR_CMD_REMOVE)
+		trace_record(TMR_TRACE_REMOVE, p_cmd->timer_id, p_cmd->start, 0, 0);
+	else if (p_cmd->type == TMR_CMD_SET_LONG)
+		trace_record(p_cmd->mode == TMR_MODE_PERIODIC ? TMR_TRACE_SET_LONG : TMR_TRACE_SET_AT64, p_cmd->timer_id, p_cmd->start,
+			(uint32)p_cmd->long_wait_us, (uint32)(p_cmd->long_wait_us >> 32));
+	else if (p_cmd->type == TMR_CMD_SET_AT)
+		trace_record(TMR_TRACE_SET_AT, p_cmd->timer_id, p_cmd->start, p_cmd->wait_us, 0);
+	else
+		trace_record(p_cmd->mode == TMR_MODE_PERIODIC ? TMR_TRACE_SET : TMR_TRACE_SET_ONCE, p_cmd->timer_id, p_cmd->start, p_cmd->wait_us, p_cmd->slack_us);
+#endif
+}
+
+/* This function starts the trace over from the current record, so trace_save writes only what is recorded after it.
+* The trace buffer is not cleared - the ISR thread keeps appending, and the records before stay taken.
+* Returns FALSE if tracing is not built in
+*/
+BOOL trace_start()
+{
+#if TMR_TRACE
+	trace_start_record = trace_records_num;
+	trace_start_dropped = trace_records_dropped;
+	return TRUE;
+#else
+	printf("ERROR: Tracing is not built in, build with TMR_TRACE 1\n");
+	return FALSE;
+#endif
+}
+
+/* This function writes the trace recorded since the start, or since trace_start, to a file, for SW_Timer_replay.c
+* Returns FALSE if the file can't be written or tracing is not built in
+*/
+BOOL trace_save(const char* path)
+{
+#if TMR_TRACE
+	FILE* p_file = port_fopen(path, "wb");
+	if (p_file == NULL) {
+		printf("ERROR: Can't open %s for writing\n", path);
+		return FALSE;
+	}
+
+	trace_header_t header = { { 'S', 'W', 'T', 'T' }, 1, TMR_FREQ_HZ, trace_records_num - trace_start_record };
+	port_memory_barrier(); // Read the records only after the count that published them
+	BOOL written = fwrite(&header, sizeof(header), 1, p_file) == 1 &&
+		fwrite(&trace_records[trace_start_record], sizeof(trace_record_t), header.records_num, p_file) == header.records_num;
+	if (fclose(p_file) != 0 || !written) {
+		printf("ERROR: Writing %s failed\n", path);
+		return FALSE;
+	}
+	if (trace_records_dropped != trace_start_dropped)
+		printf("The trace buffer was full, %u records were dropped\n", trace_records_dropped - trace_start_dropped);
+	return TRUE;
+#else
+	printf("ERROR: Tracing is not built in, build with TMR_TRACE 1\n");
+	return FALSE;
+#endif
+}
+
+/* Timer queue backends.
+* All backends implement the same interface, used by arm_timer, disarm_timer and timer_interrupt:
+* queue_init, queue_insert, queue_remove, find_minimal_remain, queue_peek and queue_collect_expired,
+* and queue_compact, which sweeps out what a lazy queue_remove left behind.
+* Every shard has a queue of its own, the timers of a shard are never queued in another shard's queue.
+*/
+#if TMR_BACKEND == TMR_BACKEND_FLAT
+/* Flat scan over the timer state arrays.
+* Only the timers' absolute deadlines are stored, so arming a timer touches no other entry and an interrupt
+* only writes the entries that expire. The queued timers are the ones set in flat_queued, a bitmap like timer_active.
+*/
+uint64 flat_queued[TMR_ACTIVE_WORDS] = { 0 }; // Bit (id % 64) of word (id / 64) is set when the timer is queued
+timer_summary_t flat_queued_summary[TMR_SHARDS] = { 0 };
+
+// This function queues a timer whose deadline is already set
+void queue_insert(timer_id_t timer_id)
+{
+	timer_bitmap_set(flat_queued, flat_queued_summary, timer_id);
+}
+
+// This function takes a timer out of the queue
+void queue_remove(timer_id_t timer_id)
+{
+	timer_bitmap_clear(flat_queued, flat_queued_summary, timer_id);
+}
+
+/* Minimum deadline kernels.
+* Each kernel returns the smallest deadlines[i] - ref over the timers set in the bitmap, 0xffffffff if none.
+* Only the non-empty 64-timer blocks marked in the bitmap's summary (summary_words words) are visited,
+* inactive entries of a block are masked to 0xffffffff so the reduction needs no branches.
+*/
+typedef uint32 (*min_key_kernel_t)(const uint32* deadlines, const uint64* active, const uint64* summary, uint32 summary_words, uint32 ref);
+
+/* Portable kernel. A block whose timers are all queued is a plain minimum loop, which the compiler may vectorize
+* for the build's target, the timers of any other block are visited one set bit at a time - a partly queued block
+* costs its queued timers only, and there is no per-entry branch on the bitmap to mispredict.
+*/
+uint32 min_key_scalar(const uint32* deadlines, const uint64* active, const uint64* summary, uint32 summary_words, uint32 ref)
+{
+	uint32 minimal_rem = 0xffffffff; // just an initial minimal_rem to begin with
+	for (uint32 summary_word = 0; summary_word < summary_words; summary_word++) {
+		// Blocks of inactive timer entries are never visited
+		uint64 blocks = summary[summary_word];
+		while (blocks != 0) {
+			uint32 word = summary_word * 64 + bit_scan_forward64(blocks);
+			blocks &= blocks - 1;
+
+			const uint32* block = &deadlines[word * 64];
+			uint64 active_bits = active[word];
+			if (active_bits == ~0ULL) {
+				for (int i = 0; i < 64; i++) {
+					uint32 rem_i = block[i] - ref;
+					if (rem_i < minimal_rem)
+						minimal_rem = rem_i;
+				}
+				continue;
+			}
+			while (active_bits != 0) {
+				uint32 rem_i = block[bit_scan_forward64(active_bits)] - ref;
+				active_bits &= active_bits - 1;
+				if (rem_i < minimal_rem)
+					minimal_rem = rem_i;
+			}
+		}
+	}
+	return minimal_rem;
+}
+
+#if TMR_HAVE_X86_SIMD
+// SSE4.1 kernel - 4 timers per _mm_min_epu32
+TMR_TARGET("sse4.1") uint32 min_key_sse41(const uint32* deadlines, const uint64* active, const uint64* summary, uint32 summary_words, uint32 ref)
+{
+	const __m128i ref_v = _mm_set1_epi32((int)ref);
+	const __m128i lane_bit = _mm_setr_epi32(1, 2, 4, 8); // The bitmap bit of each lane
+	const __m128i zero = _mm_setzero_si128();
+	__m128i min_v = _mm_set1_epi32(-1);
+	for (uint32 summary_word = 0; summary_word < summary_words; summary_word++) {
+		uint64 blocks = summary[summary_word];
+		while (blocks != 0) {
+			uint32 word = summary_word * 64 + bit_scan_forward64(blocks);
+			blocks &= blocks - 1;
+
+			uint64 active_word = active[word];
+			const uint32* block = &deadlines[word * 64];
+			for (uint32 i = 0; i < 64; i += 4) {
+				__m128i rem_v = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&block[i]), ref_v);
+				__m128i inactive = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32((int)(active_word >> i)), lane_bit), zero);
+				min_v = _mm_min_epu32(min_v, _mm_or_si128(rem_v, inactive));
+			}
+		}
+	}
+
+	// Reduce the 4 lanes
+	min_v = _mm_min_epu32(min_v, _mm_shuffle_epi32(min_v, _MM_SHUFFLE(1, 0, 3, 2)));
+	min_v = _mm_min_epu32(min_v, _mm_shuffle_epi32(min_v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32)_mm_cvtsi128_si32(min_v);
+}
+
+// AVX2 kernel - 8 timers per _mm256_min_epu32
+TMR_TARGET("avx2") uint32 min_key_avx2(const uint32* deadlines, const uint64* active, const uint64* summary, uint32 summary_words, uint32 ref)
+{
+	const __m256i ref_v = _mm256_set1_epi32((int)ref);
+	const __m256i lane_bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128); // The bitmap bit of each lane
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i min_v = _mm256_set1_epi32(-1);
+	for (uint32 summary_word = 0; summary_word < summary_words; summary_word++) {
+		uint64 blocks = summary[summary_word];
+		while (blocks != 0) {
+			uint32 word = summary_word * 64 + bit_scan_forward64(blocks);
+			blocks &= blocks - 1;
+
+			uint64 active_word = active[word];
+			const uint32* block = &deadlines[word * 64];
+			for (uint32 i = 0; i < 64; i += 8) {
+				__m256i rem_v = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)&block[i]), ref_v);
+				__m256i inactive = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int)(active_word >> i)), lane_bit), zero);
+				min_v = _mm256_min_epu32(min_v, _mm256_or_si256(rem_v, inactive));
+			}
+		}
+	}
+
+	// Reduce the 8 lanes
+	__m128i min_h = _mm_min_epu32(_mm256_castsi256_si128(min_v), _mm256_extracti128_si256(min_v, 1));
+	min_h = _mm_min_epu32(min_h, _mm_shuffle_epi32(min_h, _MM_SHUFFLE(1, 0, 3, 2)));
+	min_h = _mm_min_epu32(min_h, _mm_shuffle_epi32(min_h, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32)_mm_cvtsi128_si32(min_h);
+}
+
+// This function picks the widest minimum deadline kernel the CPU and OS support
+min_key_kernel_t select_min_key_kernel()
+{
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 1);
+	BOOL sse41 = (regs[2] >> 19) & 1;
+	BOOL ymm_enabled = ((regs[2] >> 27) & 1) && ((regs[2] >> 28) & 1) && (_xgetbv(0) & 6) == 6; // OSXSAVE, AVX, OS saves YMM
+	__cpuidex(regs, 7, 0);
+	BOOL avx2 = ymm_enabled && ((regs[1] >> 5) & 1);
+#else
+	__builtin_cpu_init();
+	BOOL sse41 = __builtin_cpu_supports("sse4.1");
+	BOOL avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if (avx2)
+		return min_key_avx2;
+	if (sse41)
+		return min_key_sse41;
+	return min_key_scalar;
+}
+#else
+min_key_kernel_t select_min_key_kernel() { return min_key_scalar; }
+#endif
+
+min_key_kernel_t min_key_kernel = min_key_scalar; // The kernel find_minimal_remain uses, set by queue_init
+
+// This function picks the minimum deadline kernel for the running CPU
+void queue_init()
+{
+	min_key_kernel = select_min_key_kernel();
+}
+
+// A function that finds minimal remain - the earliest deadline of the shard measured from last_update_timer_value
+uint32 find_minimal_remain(uint32 shard) {
+	return min_key_kernel(&timer_deadline[shard * TMR_SHARD_TIMERS], &flat_queued[shard * TMR_SHARD_WORDS],
+		flat_queued_summary[shard], TMR_SUMMARY_WORDS, last_update_timer_value);
+}
+
+// This function returns the queued timer of the shard with the earliest deadline, TMR_INVALID_ID if none is queued
+timer_id_t queue_peek(uint32 shard)
+{
+	uint32 minimal_remain = find_minimal_remain(shard);
+	timer_id_t shard_end = (shard + 1) * TMR_SHARD_TIMERS;
+	for (timer_id_t i = timer_bitmap_next(flat_queued, flat_queued_summary, shard * TMR_SHARD_TIMERS); i < shard_end;
+		i = timer_bitmap_next(flat_queued, flat_queued_summary, i + 1)) {
+		if (DEADLINE_KEY(i) == minimal_remain)
+			return i;
+	}
+	return TMR_INVALID_ID;
+}
+
+/* This function takes every queued timer of the shard that is due out of the queue into expired[], up to limit of them
+* Returns the number of expired timers
+*/
+uint32 queue_collect_expired(uint32 shard, uint32 current_timer_value, timer_id_t* expired, uint32 limit)
+{
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	uint32 expired_num = 0;
+	timer_id_t shard_end = (shard + 1) * TMR_SHARD_TIMERS;
+	for (timer_id_t i = timer_bitmap_next(flat_queued, flat_queued_summary, shard * TMR_SHARD_TIMERS); i < shard_end && expired_num < limit;
+		i = timer_bitmap_next(flat_queued, flat_queued_summary, i + 1)) {
+		if (TIMER_IS_DUE(i, elapsed)) {
+			queue_remove(i);
+			expired[expired_num++] = i;
+		}
+	}
+	return expired_num;
+}
+
+#elif TMR_BACKEND == TMR_BACKEND_HEAP
+/* Binary min-heap.
+* Each entry carries the deadline it was queued with, so sifts compare keys within the heap array.
+* With TMR_LAZY_CANCEL queue_remove leaves the timer's entry in the heap as a tombstone - most timeouts are
+* cancelled or set again before they fire, and taking an entry out costs two sifts. Every queue_insert bumps the
+* timer's generation to a new odd value and tags its entry with it, queue_remove bumps it to even: an entry is live
+* while its tag is the timer's generation, so setting a timer again pushes a new entry and never touches the old one.
+* Tombstones are dropped on their way to the root, swept out by queue_compact once there are too many of them,
+* and the heap has room for as many of them as live timers - a shard whose heap is full is rebuilt without them.
+*/
+#define TMR_HEAP_CAPACITY (TMR_LAZY_CANCEL ? 2 * TMR_SHARD_TIMERS : TMR_SHARD_TIMERS) // Entries of each shard's heap
+
+typedef struct {
+	uint32 deadline; // timer_deadline of the timer when it was queued
+	timer_id_t timer_id;
+#if TMR_LAZY_CANCEL
+	uint32 generation; // heap_generation of the timer when it was queued, a tombstone once they differ
+#endif
+} heap_entry_t;
+
+heap_entry_t timer_heap[TMR_SHARDS][TMR_HEAP_CAPACITY]; // Queued timers of each shard, ordered as a binary min-heap on deadline
+uint32 timer_heap_size[TMR_SHARDS] = { 0 }; // Number of entries of each shard's heap, tombstones included
+#if TMR_LAZY_CANCEL
+uint32 heap_generation[TMR_NUM] = { 0 }; // Odd while the timer is queued, its live entry is tagged with it
+uint32 heap_tombstones[TMR_SHARDS] = { 0 }; // Entries of each shard's heap whose timer was removed or set again
+uint32 heap_sweep_pos[TMR_SHARDS] = { 0 }; // Where queue_compact continues sweeping each shard's heap towards its root
+uint64 heap_tombstones_swept = 0; // Tombstones queue_compact took out
+uint64 heap_rebuilds = 0; // Full heaps rebuilt without their tombstones
+// A tag only repeats after 2^31 sets of the timer - before its generation wraps around, queue_insert purges the
+// timer's tombstones with heap_purge_timer, so no old entry can carry the tag it gets again
+#define HEAP_ENTRY_IS_LIVE(entry) ((entry).generation == heap_generation[(entry).timer_id])
+#define HEAP_GENERATION_LAST 0xfffffffe // Generation of a timer not queued whose next set would wrap the counter around
+#else
+uint32 heap_pos[TMR_NUM]; // Index of each timer in its shard's heap, TMR_HEAP_NONE if not queued
+#define HEAP_ENTRY_IS_LIVE(entry) TRUE
+#endif
+#define HEAP_KEY(entry) ((entry).deadline - last_update_timer_value)
+
+// This function puts an entry at a heap position, and keeps its heap_pos up to date without TMR_LAZY_CANCEL
+void heap_place(heap_entry_t* heap, uint32 pos, heap_entry_t entry)
+{
+	heap[pos] = entry;
+#if !TMR_LAZY_CANCEL
+	heap_pos[entry.timer_id] = pos;
+#endif
+}
+
+// This function moves a heap entry up until its parent expires no later than it
+void heap_sift_up(heap_entry_t* heap, uint32 pos)
+{
+	heap_entry_t entry = heap[pos];
+	uint32 key = HEAP_KEY(entry);
+	while (pos > 0) {
+		uint32 parent = (pos - 1) / 2;
+		if (HEAP_KEY(heap[parent]) <= key)
+			break;
+		heap_place(heap, pos, heap[parent]);
+		pos = parent;
+	}
+	heap_place(heap, pos, entry);
+}
+
+// This function moves a heap entry down until both its children expire no earlier than it
+void heap_sift_down(heap_entry_t* heap, uint32 heap_size, uint32 pos)
+{
+	heap_entry_t entry = heap[pos];
+	uint32 key = HEAP_KEY(entry);
+	while (TRUE) {
+		uint32 child = 2 * pos + 1;
+		if (child >= heap_size)
+			break;
+		if (child + 1 < heap_size && HEAP_KEY(heap[child + 1]) < HEAP_KEY(heap[child]))
+			child++;
+		if (HEAP_KEY(heap[child]) >= key)
+			break;
+		heap_place(heap, pos, heap[child]);
+		pos = child;
+	}
+	heap_place(heap, pos, entry);
+}
+
+// This function takes the entry at pos out of a shard's heap, the last entry moves into the hole
+void heap_delete(uint32 shard, uint32 pos)
+{
+	heap_entry_t* heap = timer_heap[shard];
+	uint32 last = --timer_heap_size[shard];
+	if (pos == last)
+		return;
+
+	// Restore the order in whichever direction it broke
+	heap_place(heap, pos, heap[last]);
+	heap_sift_down(heap, last, pos);
+	heap_sift_up(heap, pos);
+}
+
+// This function marks all timers as not queued
+void queue_init()
+{
+#if !TMR_LAZY_CANCEL
+	for (int i = 0; i < TMR_NUM; i++)
+		heap_pos[i] = TMR_HEAP_NONE;
+#endif
+}
+
+#if TMR_LAZY_CANCEL
+// This function restores the order of a shard's heap whose first heap_size entries were compacted, bottom-up in O(n)
+void heap_reorder(uint32 shard, uint32 heap_size)
+{
+	heap_entry_t* heap = timer_heap[shard];
+	heap_tombstones[shard] -= timer_heap_size[shard] - heap_size;
+	timer_heap_size[shard] = heap_size;
+	for (uint32 pos = heap_size / 2; pos-- > 0; )
+		heap_sift_down(heap, heap_size, pos);
+	heap_sweep_pos[shard] = 0;
+}
+
+// This function rebuilds a full heap out of its live entries
+void heap_rebuild(uint32 shard)
+{
+	heap_entry_t* heap = timer_heap[shard];
+	uint32 heap_size = 0;
+	for (uint32 pos = 0; pos < timer_heap_size[shard]; pos++) {
+		if (HEAP_ENTRY_IS_LIVE(heap[pos]))
+			heap[heap_size++] = heap[pos];
+	}
+	heap_reorder(shard, heap_size);
+	heap_rebuilds++;
+}
+
+// This function takes all tombstones of a timer that is not queued out of its heap, and starts its generation over
+void heap_purge_timer(timer_id_t timer_id)
+{
+	uint32 shard = TIMER_SHARD(timer_id);
+	heap_entry_t* heap = timer_heap[shard];
+	uint32 heap_size = 0;
+	for (uint32 pos = 0; pos < timer_heap_size[shard]; pos++) {
+		if (heap[pos].timer_id != timer_id)
+			heap[heap_size++] = heap[pos];
+	}
+	heap_reorder(shard, heap_size);
+	heap_generation[timer_id] = 0;
+}
+#endif
+
+// This function queues a timer whose deadline is already set
+void queue_insert(timer_id_t timer_id)
+{
+	uint32 shard = TIMER_SHARD(timer_id);
+	heap_entry_t entry;
+	entry.deadline = timer_deadline[timer_id];
+	entry.timer_id = timer_id;
+#if TMR_LAZY_CANCEL
+	if (heap_generation[timer_id] == HEAP_GENERATION_LAST)
+		heap_purge_timer(timer_id);
+	// A heap is only full with as many tombstones as live timers, at most one entry per timer is live
+	if (timer_heap_size[shard] == TMR_HEAP_CAPACITY)
+		heap_rebuild(shard);
+	entry.generation = ++heap_generation[timer_id]; // Odd, the timer was not queued
+#endif
+	uint32 pos = timer_heap_size[shard]++;
+	timer_heap[shard][pos] = entry;
+	heap_sift_up(timer_heap[shard], pos);
+}
+
+// This function takes a queued timer out of its shard's heap - with TMR_LAZY_CANCEL its entry stays as a tombstone
+void queue_remove(timer_id_t timer_id)
+{
+#if TMR_LAZY_CANCEL
+	if (!(heap_generation[timer_id] & 1))
+		return;
+	heap_generation[timer_id]++;
+	heap_tombstones[TIMER_SHARD(timer_id)]++;
+#else
+	uint32 pos = heap_pos[timer_id];
+	if (pos == TMR_HEAP_NONE)
+		return;
+	heap_delete(TIMER_SHARD(timer_id), pos);
+	heap_pos[timer_id] = TMR_HEAP_NONE;
+#endif
+}
+
+// This function pops the root of a shard's heap, a live timer leaves the queue with it
+void heap_pop_root(uint32 shard)
+{
+#if TMR_LAZY_CANCEL
+	heap_entry_t root = timer_heap[shard][0];
+	if (HEAP_ENTRY_IS_LIVE(root))
+		heap_generation[root.timer_id]++;
+	else
+		heap_tombstones[shard]--;
+#else
+	heap_pos[timer_heap[shard][0].timer_id] = TMR_HEAP_NONE;
+#endif
+	heap_delete(shard, 0);
+}
+
+// This function drops the tombstones at the root of a shard's heap, so the root is its earliest live timer
+void heap_drop_dead_root(uint32 shard)
+{
+	while (TMR_LAZY_CANCEL && timer_heap_size[shard] > 0 && !HEAP_ENTRY_IS_LIVE(timer_heap[shard][0]))
+		heap_pop_root(shard);
+}
+
+/* This function sweeps up to TMR_TOMBSTONE_SWEEP entries of a shard's heap for tombstones while they are more than
+* TMR_TOMBSTONE_PERCENT of it, so a heap full of cancelled timers is compacted over a few interrupts, none of them
+* takes longer for a larger heap, and a steady stream of cancels is swept out a few entries per interrupt. The sweep walks from the end of the heap towards the root - half the entries
+* are leaves, and the last entry moved into a leaf's hole seldom needs to sift.
+* timer_interrupt runs it once the fires are dispatched and the next interrupt is set, it never delays a fire.
+*/
+void queue_compact(uint32 shard)
+{
+#if TMR_LAZY_CANCEL
+	uint32 pos = heap_sweep_pos[shard];
+	for (uint32 i = 0; i < TMR_TOMBSTONE_SWEEP &&
+		(uint64)heap_tombstones[shard] * 100 > (uint64)timer_heap_size[shard] * TMR_TOMBSTONE_PERCENT; i++) {
+		if (pos == 0 || pos > timer_heap_size[shard])
+			pos = timer_heap_size[shard];
+		if (!HEAP_ENTRY_IS_LIVE(timer_heap[shard][pos - 1])) {
+			heap_delete(shard, pos - 1); // The last entry moved into the hole, look at it next
+			heap_tombstones[shard]--;
+			heap_tombstones_swept++;
+		}
+		else
+			pos--;
+	}
+	heap_sweep_pos[shard] = pos;
+#endif
+}
+
+// A function that finds minimal remain - the earliest deadline of the shard measured from last_update_timer_value
+uint32 find_minimal_remain(uint32 shard) {
+	// The earliest deadline sits at the heap root
+	heap_drop_dead_root(shard);
+	if (timer_heap_size[shard] == 0)
+		return 0xffffffff;
+	return HEAP_KEY(timer_heap[shard][0]);
+}
+
+// This function returns the queued timer of the shard with the earliest deadline, TMR_INVALID_ID if none is queued
+timer_id_t queue_peek(uint32 shard)
+{
+	heap_drop_dead_root(shard);
+	return timer_heap_size[shard] > 0 ? timer_heap[shard][0].timer_id : TMR_INVALID_ID;
+}
+
+/* This function pops every timer of the shard whose deadline has passed into expired[], and the timers
+* after them that are due by their slack, up to the first that isn't or limit of them
+* Returns the number of expired timers
+*/
+uint32 queue_collect_expired(uint32 shard, uint32 current_timer_value, timer_id_t* expired, uint32 limit)
+{
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	uint32 expired_num = 0;
+
+	// The root is always the earliest deadline, of a live timer once the tombstones above it are dropped
+	heap_drop_dead_root(shard);
+	while (expired_num < limit && timer_heap_size[shard] > 0 && TIMER_IS_DUE(timer_heap[shard][0].timer_id, elapsed)) {
+		expired[expired_num++] = timer_heap[shard][0].timer_id;
+		heap_pop_root(shard);
+		heap_drop_dead_root(shard);
+	}
+	return expired_num;
+}
+
+#elif TMR_BACKEND == TMR_BACKEND_WHEEL
+/* Hierarchical timing wheel.
+* The wheel works on 64-bit extended timer values, so a timer's slot never depends on the 32-bit wrap.
+* A timer is kept at the highest level where its expiry differs from the wheel time, in the slot given by
+* the expiry's digit at that level. Level 0 slots therefore hold timers that expire exactly at that
+* slot's tick, and a higher level slot is cascaded into lower levels when the wheel time reaches its start.
+* timer_interrupt only advances the wheels of the shards it services, so a shard's wheel time may lag last_update_time64.
+*/
+timer_id_t wheel_head[TMR_SHARDS][WHEEL_LEVELS][WHEEL_SLOTS]; // First timer of each slot list
+wheel_node_t wheel_nodes[TMR_NUM]; // Slot list links of each timer
+uint64 wheel_occupied[TMR_SHARDS][WHEEL_LEVELS] = { 0 }; // Bit s is set when slot s of the level is non-empty
+uint64 wheel_time[TMR_SHARDS] = { 0 }; // The extended timer value each shard's wheel was advanced to
+
+// This function empties all wheel slots and marks all timers as not queued
+void queue_init()
+{
+	for (int shard = 0; shard < TMR_SHARDS; shard++)
+		for (int level = 0; level < WHEEL_LEVELS; level++)
+			for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+				wheel_head[shard][level][slot] = WHEEL_NIL;
+	for (int i = 0; i < TMR_NUM; i++)
+		wheel_nodes[i].slot = WHEEL_NIL;
+}
+
+// This function links a timer into the slot matching its expiry with respect to its shard's wheel time
+void wheel_link(timer_id_t timer_id)
+{
+	uint32 shard = TIMER_SHARD(timer_id);
+	uint64 expiry = wheel_nodes[timer_id].expiry;
+	uint64 diff = expiry ^ wheel_time[shard];
+	uint32 level = (diff == 0) ? 0 : bit_scan_reverse64(diff) / WHEEL_SLOT_BITS;
+	uint32 slot = (uint32)(expiry >> (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1);
+
+	timer_id_t head = wheel_head[shard][level][slot];
+	wheel_nodes[timer_id].slot = level * WHEEL_SLOTS + slot;
+	wheel_nodes[timer_id].prev = WHEEL_NIL;
+	wheel_nodes[timer_id].next = head;
+	if (head != WHEEL_NIL)
+		wheel_nodes[head].prev = timer_id;
+	wheel_head[shard][level][slot] = timer_id;
+	wheel_occupied[shard][level] |= 1ULL << slot;
+}
+
+/* This function finds the next wheel event of a shard - the expiry of the nearest level 0 slot, or the time
+* the nearest higher level slot has to be cascaded. Lower levels always come first, since they only
+* hold timers that expire before the wheel time reaches the next slot of the level above.
+* Returns FALSE when the shard's wheel is empty
+*/
+BOOL wheel_next_event(uint32 shard, uint32* p_level, uint32* p_slot, uint64* p_event_time)
+{
+	for (uint32 level = 0; level < WHEEL_LEVELS; level++) {
+		uint32 shift = level * WHEEL_SLOT_BITS;
+		uint32 digit = (uint32)(wheel_time[shard] >> shift) & (WHEEL_SLOTS - 1);
+		uint64 pending = wheel_occupied[shard][level] & (~0ULL << digit);
+		if (pending == 0)
+			continue;
+
+		uint32 slot = bit_scan_forward64(pending);
+		*p_level = level;
+		*p_slot = slot;
+		*p_event_time = (((wheel_time[shard] >> shift) & ~(uint64)(WHEEL_SLOTS - 1)) | slot) << shift;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// This function queues a timer whose deadline is already set
+void queue_insert(timer_id_t timer_id)
+{
+	wheel_nodes[timer_id].expiry = TIMER_EXTEND(timer_deadline[timer_id]);
+	wheel_link(timer_id);
+}
+
+// This function takes a queued timer out of its wheel slot
+void queue_remove(timer_id_t timer_id)
+{
+	uint32 wheel_slot = wheel_nodes[timer_id].slot;
+	if (wheel_slot == WHEEL_NIL)
+		return;
+
+	uint32 shard = TIMER_SHARD(timer_id);
+	uint32 level = wheel_slot / WHEEL_SLOTS;
+	uint32 slot = wheel_slot % WHEEL_SLOTS;
+	timer_id_t next = wheel_nodes[timer_id].next;
+	timer_id_t prev = wheel_nodes[timer_id].prev;
+	if (next != WHEEL_NIL)
+		wheel_nodes[next].prev = prev;
+	if (prev != WHEEL_NIL)
+		wheel_nodes[prev].next = next;
+	else
+		wheel_head[shard][level][slot] = next;
+
+	// Slot became empty
+	if (wheel_head[shard][level][slot] == WHEEL_NIL)
+		wheel_occupied[shard][level] &= ~(1ULL << slot);
+	wheel_nodes[timer_id].slot = WHEEL_NIL;
+}
+
+/* A function that finds minimal remain - the next wheel event of the shard measured from last_update_timer_value.
+* A lagging wheel may hold a cascade that is due already, it is then reported as due right away.
+*/
+uint32 find_minimal_remain(uint32 shard) {
+	uint32 level, slot;
+	uint64 event_time;
+	if (!wheel_next_event(shard, &level, &slot, &event_time))
+		return 0xffffffff;
+	if (event_time < last_update_time64)
+		return 0;
+	return (uint32)(event_time - last_update_time64);
+}
+
+/* This function returns the queued timer of the shard with the earliest deadline, TMR_INVALID_ID if none is queued.
+* The slot of the next wheel event holds it - lower levels and earlier slots of the level are empty,
+* and every timer of a higher level expires after the timers of the slot.
+*/
+timer_id_t queue_peek(uint32 shard)
+{
+	uint32 level, slot;
+	uint64 event_time;
+	if (!wheel_next_event(shard, &level, &slot, &event_time))
+		return TMR_INVALID_ID;
+
+	// All timers of a level 0 slot expire at its tick
+	timer_id_t earliest = wheel_head[shard][level][slot];
+	if (level == 0)
+		return earliest;
+	for (timer_id_t i = wheel_nodes[earliest].next; i != WHEEL_NIL; i = wheel_nodes[i].next) {
+		if (wheel_nodes[i].expiry < wheel_nodes[earliest].expiry)
+			earliest = i;
+	}
+	return earliest;
+}
+
+/* This function advances the shard's wheel to current_timer_value, cascading the higher level slots it passes
+* and collecting every timer of the level 0 slots it passes into expired[]. The timers after them that are
+* due by their slack follow, up to the first that isn't.
+* Once limit timers are collected the wheel stops at the slot it is in, the rest of the slot stays queued.
+* Returns the number of expired timers
+*/
+uint32 queue_collect_expired(uint32 shard, uint32 current_timer_value, timer_id_t* expired, uint32 limit)
+{
+	uint32 level, slot;
+	uint64 event_time;
+	uint64 current_time = TIMER_EXTEND(current_timer_value);
+	uint32 expired_num = 0;
+
+	while (wheel_next_event(shard, &level, &slot, &event_time) && event_time <= current_time) {
+		wheel_time[shard] = event_time;
+		if (level == 0) {
+			// Take the slot's timers one by one, they all expire at its tick
+			while (wheel_head[shard][0][slot] != WHEEL_NIL) {
+				if (expired_num == limit)
+					return expired_num;
+				timer_id_t timer_id = wheel_head[shard][0][slot];
+				queue_remove(timer_id);
+				expired[expired_num++] = timer_id;
+			}
+			continue;
+		}
+
+		// Detach the whole slot list
+		timer_id_t timer_id = wheel_head[shard][level][slot];
+		wheel_head[shard][level][slot] = WHEEL_NIL;
+		wheel_occupied[shard][level] &= ~(1ULL << slot);
+
+		while (timer_id != WHEEL_NIL) {
+			timer_id_t next = wheel_nodes[timer_id].next;
+			wheel_nodes[timer_id].slot = WHEEL_NIL;
+			wheel_link(timer_id); // Cascade into a lower level relative to the new wheel time
+			timer_id = next;
+		}
+	}
+
+	wheel_time[shard] = current_time;
+
+	// Without timers that have slack the wheel time already passed every due timer
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	for (timer_id_t i = timer_slack_num != 0 ? queue_peek(shard) : TMR_INVALID_ID; expired_num < limit && i != TMR_INVALID_ID && TIMER_IS_DUE(i, elapsed); i = queue_peek(shard)) {
+		queue_remove(i);
+		expired[expired_num++] = i;
+	}
+	return expired_num;
+}
+#endif
+
+#if TMR_BACKEND != TMR_BACKEND_HEAP
+// The flat and wheel backends take a timer out in O(1) and leave nothing behind, so this function compacts nothing
+void queue_compact(uint32 shard)
+{
+}
+#endif
+
+
+/* Shards.
+* Every shard has its own timer queue, command ring, ID allocation and cached next deadline. A producer thread
+* binds to a shard with timer_shard_bind and then sets, removes, allocates and frees only the shard's timer IDs,
+* so each ring keeps a single producer and arming a timer only writes the shard's own cache lines.
+* timer_interrupt services only the shards with new commands or a due deadline, and programs the compare
+* value from the earliest next deadline across the shards.
+* On hosted ports each shard of a sharded build takes whole pages, which the thread bound to it writes first, so the
+* OS places them on that thread's NUMA node (first touch, on Linux and Windows alike). The timer queues are written
+* by the ISR thread only, they stay wherever it touched them.
+*/
+#if TMR_SHARDS > 1 && TMR_PORT_HOSTED
+#define TMR_SHARD_ALIGNED TMR_PAGE_ALIGNED
+#else
+#define TMR_SHARD_ALIGNED TMR_CACHE_ALIGNED
+#endif
+
+typedef struct {
+	// Producer side - written by the thread bound to the shard only
+	TMR_SHARD_ALIGNED volatile uint32 cmd_head; // Next command ring slot to fill
+	uint64 allocated[TMR_SHARD_WORDS]; // Bit (id % 64) of word (id % TMR_SHARD_TIMERS / 64) is set for IDs handed out
+	uint64 alloc_full[TMR_SUMMARY_WORDS]; // Bit w is set when every ID of allocated[w] is taken
+
+	// Consumer side - written by timer_interrupt only
+	TMR_CACHE_ALIGNED volatile uint32 cmd_tail; // Next command ring slot to apply
+	uint32 next_deadline; // The earliest deadline (or wheel event) of the shard's queue, if has_deadline
+	BOOL has_deadline; // FALSE when the shard's queue is empty
+
+	TMR_CACHE_ALIGNED timer_cmd_t cmd_queue[TMR_CMD_QUEUE_SIZE];
+} timer_shard_t;
+
+timer_shard_t timer_shards[TMR_SHARDS];
+uint64 timer_shards_changed = 0; // Bit s is set when shard s's queue changed since its next deadline was found
+TMR_THREAD_LOCAL uint32 timer_thread_shard = 0; // The shard the calling thread is bound to
+
+/* This function binds the calling thread to a shard, and pins it to the CPU core of the same number where
+* the system has one. Threads start bound to shard 0.
+* Returns FALSE if the shard number exceeds limit
+*/
+BOOL timer_shard_bind(uint32 shard)
+{
+	if (shard >= TMR_SHARDS) {
+		printf("ERROR: Shard exceeds limit, maximal is: %d\n", TMR_SHARDS - 1);
+		return FALSE;
+	}
+
+	port_thread_pin(shard); // Best effort, the binding doesn't depend on it
+	timer_thread_shard = shard;
+
+#if TMR_SHARDS > 1 && TMR_PORT_HOSTED
+	// Fault the shard's pages in from the pinned thread - nothing writes them before the thread bound to the shard pushes
+	volatile uint8* p_shard_bytes = (volatile uint8*)&timer_shards[shard];
+	for (size_t offset = 0; offset < sizeof(timer_shard_t); offset += TMR_PAGE_SIZE)
+		p_shard_bytes[offset] = p_shard_bytes[offset];
+#endif
+	return TRUE;
+}
+
+/* Dedicated HW compare channels.
+* Each channel but 0 holds one timer out of the timer queue and interrupts timer_channel_interrupt at its deadline,
+* which fires the timer without walking the queue. hw_channels_schedule keeps the nearest deadlines on the channels:
+* while a channel is free, or the earliest queued timer expires before the latest channel timer, the two trade places.
+* Like the queues, the channel timers only change in interrupt context.
+*/
+timer_id_t channel_timer[TMR_HW_CHANNELS]; // The timer each dedicated channel holds, entry 0 unused
+uint32 hw_channels_used = 0; // Bit c is set when dedicated channel c holds channel_timer[c]
+
+// Returns the dedicated channel holding the timer, 0 if the timer is not on a channel
+uint32 hw_channel_of(timer_id_t timer_id)
+{
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if (((hw_channels_used >> channel) & 1) && channel_timer[channel] == timer_id)
+			return channel;
+	}
+	return 0;
+}
+
+// This function frees the dedicated channel of a timer that is re-armed or deactivated
+void hw_channel_release(timer_id_t timer_id)
+{
+	uint32 channel = hw_channel_of(timer_id);
+	if (channel != 0)
+		hw_channels_used &= ~(1u << channel);
+}
+
+/* This function collects every channel timer that is due into expired[], the timers keep their channels
+* Returns the number of expired timers
+*/
+uint32 hw_channels_collect_expired(uint32 current_timer_value, timer_id_t* expired)
+{
+	uint32 expired_num = 0;
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if (((hw_channels_used >> channel) & 1) && TIMER_IS_DUE(channel_timer[channel], current_timer_value - last_update_timer_value))
+			expired[expired_num++] = channel_timer[channel];
+	}
+	return expired_num;
+}
+
+// This function moves the nearest-deadline timers between the timer queues and the dedicated channels
+void hw_channels_schedule()
+{
+	while (TMR_HW_CHANNELS > 1) {
+		// The earliest queued timer of all shards
+		timer_id_t queued_id = TMR_INVALID_ID;
+		for (uint32 shard = 0; shard < TMR_SHARDS; shard++) {
+			timer_id_t shard_id = queue_peek(shard);
+			if (shard_id != TMR_INVALID_ID && (queued_id == TMR_INVALID_ID || DEADLINE_KEY(shard_id) < DEADLINE_KEY(queued_id)))
+				queued_id = shard_id;
+		}
+		if (queued_id == TMR_INVALID_ID)
+			return;
+
+		// A free channel, otherwise the channel whose timer expires last
+		uint32 channel = 1;
+		for (uint32 i = 1; i < TMR_HW_CHANNELS; i++) {
+			if (!((hw_channels_used >> i) & 1)) {
+				channel = i;
+				break;
+			}
+			if (DEADLINE_KEY(channel_timer[i]) > DEADLINE_KEY(channel_timer[channel]))
+				channel = i;
+		}
+		BOOL channel_used = (hw_channels_used >> channel) & 1;
+		if (channel_used && DEADLINE_KEY(channel_timer[channel]) <= DEADLINE_KEY(queued_id))
+			return; // The channels hold the nearest deadlines
+
+		queue_remove(queued_id);
+		timer_shards_changed |= 1ULL << TIMER_SHARD(queued_id);
+		if (channel_used) {
+			queue_insert(channel_timer[channel]);
+			timer_shards_changed |= 1ULL << TIMER_SHARD(channel_timer[channel]);
+		}
+		channel_timer[channel] = queued_id;
+		hw_channels_used |= 1u << channel;
+	}
+}
+
+/* Overflow list - long timers, whose interval does not fit the 32-bit timer value, wait here out of the timer queues
+* until their extended expiry is less than TMR_PARK_HORIZON ahead of last_update_time64. The queues and their 32-bit
+* keys never see them far off, and timer_interrupt only compares last_update_time64 to overflow_next_unpark on every
+* interrupt - the parked timers are walked when one of them is due to move into its queue.
+*/
+#define TMR_PARK_HORIZON 0x80000000ULL // More than TMR_MAX_CMP_DISTANCE, timer_interrupt always runs before a parked timer is due
+uint64 overflow_parked[TMR_ACTIVE_WORDS] = { 0 }; // Bit set for each parked timer
+timer_summary_t overflow_parked_summary[TMR_SHARDS] = { 0 };
+uint64 overflow_next_unpark = ~0ULL; // last_update_time64 at which the earliest parked timer is due, may be early after removals
+
+// This function parks a long timer until its timer_expiry64 comes near, or queues it if it already is
+void overflow_park(timer_id_t timer_id)
+{
+	uint64 expiry = timer_expiry64[timer_id];
+	if (expiry - last_update_time64 < TMR_PARK_HORIZON) {
+		timer_deadline[timer_id] = (uint32)expiry;
+		queue_insert(timer_id);
+		return;
+	}
+
+	timer_bitmap_set(overflow_parked, overflow_parked_summary, timer_id);
+	if (expiry - TMR_PARK_HORIZON < overflow_next_unpark)
+		overflow_next_unpark = expiry - TMR_PARK_HORIZON;
+}
+
+// This function takes a timer off the overflow list, if it is parked
+void overflow_remove(timer_id_t timer_id)
+{
+	timer_bitmap_clear(overflow_parked, overflow_parked_summary, timer_id);
+}
+
+// This function moves the parked timers whose expiry came near into their queues, after last_update_time64 moved
+void overflow_unpark_due()
+{
+	if (last_update_time64 < overflow_next_unpark)
+		return;
+
+	overflow_next_unpark = ~0ULL;
+	for (timer_id_t i = timer_bitmap_next(overflow_parked, overflow_parked_summary, 0); i != TMR_INVALID_ID;
+		i = timer_bitmap_next(overflow_parked, overflow_parked_summary, i + 1)) {
+		uint64 expiry = timer_expiry64[i];
+		if (expiry - last_update_time64 < TMR_PARK_HORIZON) {
+			overflow_remove(i);
+			overflow_park(i);
+			timer_shards_changed |= 1ULL << TIMER_SHARD(i);
+		}
+		else if (expiry - TMR_PARK_HORIZON < overflow_next_unpark)
+			overflow_next_unpark = expiry - TMR_PARK_HORIZON;
+	}
+}
+
+/* Single-producer/single-consumer command rings, one per shard.
+* set_timer and remove_timer (the producer, the thread bound to the shard) never touch the timer queue, they push
+* a command and raise a software interrupt. timer_interrupt (the consumer) applies all pending commands in one
+* batch, so the queues are only ever modified in interrupt context and neither side takes a lock.
+* Each index is written by one side only, the barriers order the slot accesses with the index updates.
+*/
+
+// Returns TRUE if the calling thread may queue commands for the timer - it is bound to the timer's shard
+BOOL timer_shard_owned(timer_id_t timer_id)
+{
+#if TMR_SHARDS > 1
+	if (TIMER_SHARD(timer_id) != timer_thread_shard) {
+		printf("ERROR: Timer belongs to shard %u, this thread is bound to shard %u\n", TIMER_SHARD(timer_id), timer_thread_shard);
+		return FALSE;
+	}
+#endif
+	return TRUE;
+}
+
+// This function appends a command to the ring of the timer's shard, returns FALSE if the ring is full
+BOOL enqueue_timer_cmd(const timer_cmd_t* p_cmd)
+{
+	timer_shard_t* p_shard = &timer_shards[TIMER_SHARD(p_cmd->timer_id)];
+	uint32 head = p_shard->cmd_head;
+	if (head - p_shard->cmd_tail == TMR_CMD_QUEUE_SIZE)
+		return FALSE;
+
+	p_shard->cmd_queue[head & (TMR_CMD_QUEUE_SIZE - 1)] = *p_cmd;
+	port_memory_barrier(); // The command must be visible before the new head
+	p_shard->cmd_head = head + 1;
+	return TRUE;
+}
+
+// This function raises the timer interrupt by software, which applies all queued commands
+void raise_timer_swi()
+{
+	tmr_swi_reg = 1;
+	HW_TIMER_REG_WRITTEN();
+}
+
+/* This function pushes a command to the ring of the timer's shard and raises the timer interrupt to apply it
+* Returns FALSE if the timer belongs to another shard than the calling thread's, or the ring is full
+*/
+BOOL push_timer_cmd(const timer_cmd_t* p_cmd)
+{
+	if (!timer_shard_owned(p_cmd->timer_id))
+		return FALSE;
+
+	if (!enqueue_timer_cmd(p_cmd)) {
+		printf("ERROR: Timer command queue is full\n");
+		return FALSE;
+	}
+
+	raise_timer_swi();
+	return TRUE;
+}
+
+/* This function arms a timer in interrupt context, start is the timer value the interval is measured from.
+* The timer fires between wait_us and wait_us + slack_us after start, once or every interval by mode.
+* Timer callbacks may call it (and disarm_timer) directly, the next interrupt is set after they return.
+*/
+void arm_timer(timer_id_t timer_id, uint32 wait_us, uint32 slack_us, timer_mode_t mode, uint32 start, timer_cb_t cb, void* cb_ctx)
+{
+	// Re-arming an active timer - take it out of the queue, off its channel or the overflow list first
+	queue_remove(timer_id);
+	hw_channel_release(timer_id);
+	overflow_remove(timer_id);
+	if (TIMER_IS_ACTIVE(timer_id) && timer_slack_us[timer_id] != 0)
+		timer_slack_num--;
+
+	// Assign values of the new timer, wait_us==0 leaves it inactive
+	timer_wait_us[timer_id] = wait_us;
+	timer_long_wait_us[timer_id] = 0;
+	timer_slack_us[timer_id] = slack_us;
+	timer_deadline[timer_id] = start + wait_us + slack_us;
+	timer_times_fired[timer_id] = 0;
+	timer_overruns[timer_id] = 0;
+	stats_reset_timer(timer_id);
+	timer_mode[timer_id] = (uint8)mode;
+	timer_callbacks[timer_id].cb = cb;
+	timer_callbacks[timer_id].cb_ctx = cb_ctx;
+	if (wait_us != 0) {
+		set_active_bit(timer_id);
+		queue_insert(timer_id);
+		if (slack_us != 0)
+			timer_slack_num++;
+	}
+	else
+		clear_active_bit(timer_id);
+	timer_shards_changed |= 1ULL << TIMER_SHARD(timer_id);
+}
+
+/* This function arms a long timer in interrupt context - its interval wait_us may exceed the 32-bit timer value range.
+* It fires at the extended timer value expiry, then every wait_us after that or never again by mode.
+*/
+void arm_long_timer(timer_id_t timer_id, uint64 wait_us, timer_mode_t mode, uint64 expiry, timer_cb_t cb, void* cb_ctx)
+{
+	arm_timer(timer_id, 0, 0, mode, 0, cb, cb_ctx); // Takes the timer out of wherever it was, inactive
+	timer_wait_us[timer_id] = 0xffffffff;
+	timer_long_wait_us[timer_id] = wait_us;
+	timer_expiry64[timer_id] = expiry;
+	set_active_bit(timer_id);
+	overflow_park(timer_id);
+}
+
+// This function deactivates a timer in interrupt context, its fire count stays until the timer is armed again.
+// An inactive timer is left as it is.
+void disarm_timer(timer_id_t timer_id)
+{
+	if (!TIMER_IS_ACTIVE(timer_id))
+		return;
+	queue_remove(timer_id);
+	hw_channel_release(timer_id);
+	overflow_remove(timer_id);
+	if (timer_slack_us[timer_id] != 0)
+		timer_slack_num--;
+	clear_active_bit(timer_id);
+	timer_wait_us[timer_id] = 0;
+	timer_long_wait_us[timer_id] = 0;
+	timer_shards_changed |= 1ULL << TIMER_SHARD(timer_id);
+}
+
+/* This function applies every command pushed to the shard's ring since the last interrupt
+* Must run before the expired timers are collected, with last_update_timer_value still the previous update
+*/
+void drain_timer_cmds(timer_shard_t* p_shard, uint32 current_timer_value)
+{
+	uint32 tail = p_shard->cmd_tail;
+	uint32 head = p_shard->cmd_head;
+	port_memory_barrier(); // Read the commands only after the head that published them
+
+	for (; tail != head; tail++) {
+		const timer_cmd_t* p_cmd = &p_shard->cmd_queue[tail & (TMR_CMD_QUEUE_SIZE - 1)];
+		trace_record_cmd(p_cmd);
+		if (p_cmd->type == TMR_CMD_SET_LONG) {
+			// The start was read shortly before, extend it back from the current timer value
+			uint64 start = TIMER_EXTEND(current_timer_value) - (uint32)(current_timer_value - p_cmd->start);
+			arm_long_timer(p_cmd->timer_id, p_cmd->long_wait_us, (timer_mode_t)p_cmd->mode, start + p_cmd->long_wait_us, p_cmd->cb, p_cmd->cb_ctx);
+		}
+		else if (p_cmd->type != TMR_CMD_REMOVE) {
+			// An interrupt that ran after set_timer read the timer value already moved last_update_timer_value
+			// past the start. Measure from last_update_timer_value then, so the deadline is never behind it.
+			uint32 start = p_cmd->start;
+			uint32 wait_us = p_cmd->wait_us;
+			if (start - last_update_timer_value > current_timer_value - last_update_timer_value) {
+				uint32 late = last_update_timer_value - start;
+				if (p_cmd->type == TMR_CMD_SET_AT)
+					wait_us = wait_us > late ? wait_us - late : 1; // Keep the absolute deadline, one already passed fires on the next tick
+				start = last_update_timer_value;
+			}
+			arm_timer(p_cmd->timer_id, wait_us, p_cmd->slack_us, (timer_mode_t)p_cmd->mode, start, p_cmd->cb, p_cmd->cb_ctx);
+		}
+		else
+			disarm_timer(p_cmd->timer_id);
+	}
+
+	// Done with the slots before handing them back to the producer. The producer reads the tail on every push,
+	// a shard without commands keeps its line clean
+	if (tail != p_shard->cmd_tail) {
+		port_memory_barrier();
+		p_shard->cmd_tail = tail;
+	}
+}
+
+// Returns TRUE if the arguments of set_timer_slack are in range
+BOOL timer_args_valid(timer_id_t timer_id, uint32 wait_us, uint32 slack_us)
+{
+	// input Timer ID exceeds limit
+	if (timer_id >= TMR_NUM) {
+		printf("ERROR: Timer ID exceeds limit, maximal is: %d\n", TMR_NUM-1);
+		return FALSE;
+	}
+
+	// The hard expiry has to fit the 32-bit timer value range like the interval alone
+	if (slack_us > 0xffffffff - wait_us) {
+		printf("ERROR: Interval plus slack exceeds limit, maximal is: %u\n", 0xffffffff);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* A function that sets a new timer with a slack and a callback, which is called in interrupt context each time the timer fires.
+* Each period the timer fires between wait_us and wait_us + slack_us after the previous one, so it can share an interrupt
+* with timers that are due around the same time.
+* The timer is armed by the next timer interrupt, which this call raises. Must be called from the thread bound to the timer's shard.
+* Returns FALSE if the timer ID or the slack is invalid, the timer belongs to another shard, or the command queue is full
+*/
+BOOL set_timer_slack(timer_id_t timer_id, uint32 wait_us, uint32 slack_us, timer_cb_t cb, void* cb_ctx) {
+
+	if (!timer_args_valid(timer_id, wait_us, slack_us))
+		return FALSE;
+
+	// Read current timer value so the new deadline is relative to this time
+	timer_cmd_t cmd = { TMR_CMD_SET, timer_id, wait_us, slack_us, tmr_val_reg, TMR_MODE_PERIODIC, cb, cb_ctx, 0 };
+	return push_timer_cmd(&cmd);
+}
+
+/* A function that sets a one-shot timer - it fires once, wait_us after this call, and is deactivated before its
+* callback runs, which may set it again. Otherwise like set_timer_cb.
+*/
+BOOL set_timer_once(timer_id_t timer_id, uint32 wait_us, timer_cb_t cb, void* cb_ctx) {
+
+	if (!timer_args_valid(timer_id, wait_us, 0))
+		return FALSE;
+
+	timer_cmd_t cmd = { TMR_CMD_SET, timer_id, wait_us, 0, tmr_val_reg, TMR_MODE_ONE_SHOT, cb, cb_ctx, 0 };
+	return push_timer_cmd(&cmd);
+}
+
+/* A function that sets a one-shot timer to fire when the timer value reaches abs_tick, see set_timer_once.
+* abs_tick is taken as ahead of the current timer value by up to 0x7fffffff ticks.
+* Returns FALSE if abs_tick is not in that range, or as set_timer_once
+*/
+BOOL set_timer_at(timer_id_t timer_id, uint32 abs_tick, timer_cb_t cb, void* cb_ctx) {
+
+	uint32 start = tmr_val_reg;
+	uint32 wait_us = abs_tick - start;
+	if (wait_us == 0 || wait_us > 0x7fffffff) {
+		printf("ERROR: Deadline %u is not ahead of the current timer value %u\n", abs_tick, start);
+		return FALSE;
+	}
+
+	if (!timer_args_valid(timer_id, wait_us, 0))
+		return FALSE;
+
+	timer_cmd_t cmd = { TMR_CMD_SET_AT, timer_id, wait_us, 0, start, TMR_MODE_ONE_SHOT, cb, cb_ctx, 0 };
+	return push_timer_cmd(&cmd);
+}
+
+// A function that sets a new timer with a callback and no slack, see set_timer_slack
+BOOL set_timer_cb(timer_id_t timer_id, uint32 wait_us, timer_cb_t cb, void* cb_ctx) {
+	return set_timer_slack(timer_id, wait_us, 0, cb, cb_ctx);
+}
+
+// A function that sets a new timer without a callback, see set_timer_cb
+BOOL set_timer(timer_id_t timer_id, uint32 wait_us) {
+	return set_timer_cb(timer_id, wait_us, NULL, NULL);
+}
+
+/* This function returns the current timer value extended to 64 bits, see last_update_time64. It never wraps, so
+* 64-bit timer values can be compared directly. May be called from any thread, and from timer callbacks.
+* On 32-bit targets the 64-bit read is two loads the timer interrupt can come between, so it is read until two reads
+* match - the interrupt writes the whole value before the thread goes on, and last_update_time64 only grows, so a
+* torn read is never repeated. A timer_state_seq read would spin forever in a callback, which runs while the
+* interrupt holds the sequence odd.
+*/
+uint64 timer_now64()
+{
+	uint64 last_update;
+	do {
+		last_update = *(volatile uint64*)&last_update_time64;
+	} while (last_update != *(volatile uint64*)&last_update_time64);
+	port_acquire_barrier(); // The timer value must not be read before the time base it is measured from
+	return last_update + (uint32)(tmr_val_reg - (uint32)last_update);
+}
+
+/* A function that sets a periodic timer whose interval may exceed the 32-bit timer value range (~71.6 minutes).
+* An interval that fits 32 bits sets the timer like set_timer_cb, a longer one parks it on the overflow list
+* between fires.
+*/
+BOOL set_timer_long(timer_id_t timer_id, uint64 wait_us, timer_cb_t cb, void* cb_ctx) {
+
+	if (wait_us <= 0xffffffff)
+		return set_timer_cb(timer_id, (uint32)wait_us, cb, cb_ctx);
+
+	if (!timer_args_valid(timer_id, 0, 0))
+		return FALSE;
+
+	timer_cmd_t cmd = { TMR_CMD_SET_LONG, timer_id, 0, 0, tmr_val_reg, TMR_MODE_PERIODIC, cb, cb_ctx, wait_us };
+	return push_timer_cmd(&cmd);
+}
+
+/* A function that sets a one-shot timer to fire when the extended timer value (see timer_now64) reaches abs_time,
+* however far ahead. Otherwise like set_timer_once.
+* Returns FALSE if abs_time is not ahead of the current extended timer value, or as set_timer_once
+*/
+BOOL set_timer_at64(timer_id_t timer_id, uint64 abs_time, timer_cb_t cb, void* cb_ctx) {
+
+	uint64 now = timer_now64();
+	if (abs_time <= now) {
+		printf("ERROR: Deadline %llu is not ahead of the current timer value %llu\n", abs_time, now);
+		return FALSE;
+	}
+
+	if (!timer_args_valid(timer_id, 0, 0))
+		return FALSE;
+
+	timer_cmd_t cmd = { TMR_CMD_SET_LONG, timer_id, 0, 0, (uint32)now, TMR_MODE_ONE_SHOT, cb, cb_ctx, abs_time - now };
+	return push_timer_cmd(&cmd);
+}
+
+/* A function that sets req_num timers at once, each like set_timer_slack, measured from a single timer value reading.
+* All commands are queued before the timer interrupt is raised, so one interrupt applies them and writes the compare
+* register once, instead of one interrupt per timer. When the batch does not fit the shard's command ring, the call
+* raises the interrupt and waits for it to make room - in event loop mode, where no ISR thread drains the ring, it runs
+* the interrupt inline. The timers queued after that are measured from the interrupt that applies them if it ran past
+* the start.
+* Returns FALSE, with none of the timers set, if any request is invalid or belongs to another shard than the calling thread's
+*/
+BOOL set_timers_batch(const timer_req_t* reqs, uint32 req_num) {
+
+	// Check the whole batch first so it is applied entirely or not at all
+	for (uint32 i = 0; i < req_num; i++) {
+		if (!timer_args_valid(reqs[i].timer_id, reqs[i].wait_us, reqs[i].slack_us) || !timer_shard_owned(reqs[i].timer_id))
+			return FALSE;
+	}
+
+	uint32 start = tmr_val_reg;
+	for (uint32 i = 0; i < req_num; i++) {
+		timer_cmd_t cmd = { TMR_CMD_SET, reqs[i].timer_id, reqs[i].wait_us, reqs[i].slack_us, start, TMR_MODE_PERIODIC, reqs[i].cb, reqs[i].cb_ctx, 0 };
+		while (!enqueue_timer_cmd(&cmd)) {
+			raise_timer_swi();
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+			timer_event_loop_dispatch(); // The interrupt only runs on this thread
+#else
+			port_yield(); // Let the interrupt drain the ring
+#endif
+		}
+	}
+
+	raise_timer_swi();
+	return TRUE;
+}
+
+/* Bottom half - with TMR_BH_WORKERS, timer_interrupt (the top half) reloads the fired timers and hands each fire to
+* a worker through a single-producer/single-consumer fire ring, like the command rings the other way. The worker runs
+* the fire's statistics and callback outside interrupt context, so the interrupt's time doesn't grow with the callbacks.
+* The fires of a timer always go to worker timer_id % TMR_BH_WORKERS, so its callbacks run in order, one at a time.
+* An interrupt fires no more timers than every ring has room for - when a ring is short of room the interrupt stalls
+* the rest, and the worker raises the timer interrupt again once it has made room.
+*/
+// A fire handed to a bottom-half worker, with the callback the timer had when it fired
+typedef struct {
+	timer_id_t timer_id;
+	uint32 late_us; // How late it fired after its hard expiry
+	timer_callback_t callback;
+} timer_fire_t;
+
+typedef struct {
+	// Producer side - written by timer_interrupt only
+	TMR_CACHE_ALIGNED volatile uint32 fire_head; // Next fire ring slot to fill
+	BOOL wake_pending; // Fires were queued since the worker was last signaled
+
+	// Consumer side - written by the worker only
+	TMR_CACHE_ALIGNED volatile uint32 fire_tail; // Next fire ring slot to run
+	uint64 fires_run; // Fires whose callbacks the worker ran
+#if TMR_BH_THREADS
+	port_thread_t h_thread;
+	port_event_t wake_event; // Auto-reset event the top half signals after queueing fires
+#endif
+
+	TMR_CACHE_ALIGNED timer_fire_t fire_queue[TMR_BH_QUEUE_SIZE];
+} timer_bh_worker_t;
+
+#if TMR_BH_WORKERS > 0
+timer_bh_worker_t timer_bh_workers[TMR_BH_WORKERS];
+#endif
+volatile uint32 timer_bh_stalled = 0; // Set while an interrupt left due timers for lack of fire ring room
+uint64 timer_bh_stalls = 0; // Interrupts that left due timers for lack of fire ring room, see timer_fire_budget
+uint64 timer_isr_capped = 0; // Interrupts that left due timers to the next one by TMR_ISR_FIRE_CAP
+
+// Returns the fewest free slots of all fire rings
+uint32 timer_bh_room()
+{
+	uint32 room = TMR_BH_QUEUE_SIZE;
+#if TMR_BH_WORKERS > 0
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++) {
+		timer_bh_worker_t* p_worker = &timer_bh_workers[worker];
+		uint32 worker_room = TMR_BH_QUEUE_SIZE - (p_worker->fire_head - p_worker->fire_tail);
+		if (worker_room < room)
+			room = worker_room;
+	}
+#endif
+	return room;
+}
+
+/* Returns how many queued timers the current interrupt may fire - TMR_ISR_FIRE_CAP, less when the fire rings don't
+* have room for them besides the fires of the dedicated channels, and 0 when they don't have room for those either
+*/
+uint32 timer_fire_budget()
+{
+	uint32 budget = TMR_ISR_FIRE_CAP;
+#if TMR_BH_WORKERS > 0
+	uint32 room = timer_bh_room();
+	if (room < budget + TMR_HW_CHANNELS - 1) {
+		// Raise the stall flag before looking again, so a worker that made room in between either shows in the room
+		// or sees the flag and raises the interrupt. A flag left raised only costs an extra interrupt
+		timer_bh_stalled = 1;
+		port_memory_barrier();
+		room = timer_bh_room();
+		if (room < budget + TMR_HW_CHANNELS - 1)
+			budget = room >= TMR_HW_CHANNELS ? room - (TMR_HW_CHANNELS - 1) : 0;
+	}
+#endif
+	return budget;
+}
+
+// This function queues a fire to the worker of its timer, the top half made sure the ring has room
+void timer_bh_push(timer_id_t timer_id, uint32 late_us)
+{
+#if TMR_BH_WORKERS > 0
+	timer_bh_worker_t* p_worker = &timer_bh_workers[timer_id % TMR_BH_WORKERS];
+	uint32 head = p_worker->fire_head;
+	timer_fire_t* p_fire = &p_worker->fire_queue[head & (TMR_BH_QUEUE_SIZE - 1)];
+	p_fire->timer_id = timer_id;
+	p_fire->late_us = late_us;
+	p_fire->callback = timer_callbacks[timer_id];
+	port_memory_barrier(); // The fire must be visible before the new head
+	p_worker->fire_head = head + 1;
+	p_worker->wake_pending = TRUE;
+#endif
+}
+
+// This function wakes the workers that got fires from the current interrupt - once per interrupt, not per fire
+void timer_bh_wake()
+{
+#if TMR_BH_THREADS
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++) {
+		timer_bh_worker_t* p_worker = &timer_bh_workers[worker];
+		if (!p_worker->wake_pending)
+			continue;
+		p_worker->wake_pending = FALSE;
+		if (!port_event_signal(&p_worker->wake_event))
+		{ // waking the worker failed
+			printf("ERROR: port_event_signal - bottom-half worker\n");
+			g_no_errors = FALSE;
+		}
+	}
+#endif
+}
+
+/* This function runs the statistics and callbacks of the fires queued for a bottom-half worker, in the order the
+* timers fired. Callbacks run outside interrupt context, so they may not call arm_timer or disarm_timer.
+* The worker threads call it on hosted ports, an application on bare metal or in event loop mode calls it for every
+* worker from its main loop.
+* Returns the number of fires run
+*/
+uint32 timer_bh_run(uint32 worker)
+{
+#if TMR_BH_WORKERS > 0
+	timer_bh_worker_t* p_worker = &timer_bh_workers[worker];
+	uint32 tail = p_worker->fire_tail;
+	uint32 head = p_worker->fire_head;
+	port_memory_barrier(); // Read the fires only after the head that published them
+
+	for (; tail != head; tail++) {
+		const timer_fire_t* p_fire = &p_worker->fire_queue[tail & (TMR_BH_QUEUE_SIZE - 1)];
+		stats_record_fire(p_fire->timer_id, p_fire->late_us);
+		if (p_fire->callback.cb != NULL)
+			p_fire->callback.cb(p_fire->timer_id, p_fire->callback.cb_ctx);
+	}
+
+	uint32 fires_num = tail - p_worker->fire_tail;
+	p_worker->fires_run += fires_num;
+	port_memory_barrier(); // Done with the slots before handing them back to the top half
+	p_worker->fire_tail = tail;
+
+	// An interrupt stalled for room - fire the timers it left now
+	if (fires_num != 0 && port_atomic_exchange32(&timer_bh_stalled, 0) != 0)
+		raise_timer_swi();
+	return fires_num;
+#else
+	return 0;
+#endif
+}
+
+// This function runs the fires queued for every worker, for applications that have no worker threads. Returns the number run
+uint32 timer_bh_run_all()
+{
+	uint32 fires_num = 0;
+#if TMR_BH_WORKERS > 0
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++)
+		fires_num += timer_bh_run(worker);
+#endif
+	return fires_num;
+}
+
+#if TMR_BH_THREADS
+volatile uint32 timer_bh_next_worker = 0; // The worker the thread being created runs, handed over by timer_bh_start
+port_event_t timer_bh_started_event; // Signaled by a new worker thread once it took its worker number
+
+// Entry point of a bottom-half worker thread - sleeps until the top half queues fires for it, then runs them
+void timer_bh_thread()
+{
+	uint32 worker = timer_bh_next_worker;
+	timer_bh_worker_t* p_worker = &timer_bh_workers[worker];
+	port_event_signal(&timer_bh_started_event);
+	while (g_no_errors) {
+		if (!port_event_wait(&p_worker->wake_event, PORT_WAIT_FOREVER))
+		{ // waiting for fires failed
+			printf("ERROR: port_event_wait - bottom-half worker\n");
+			g_no_errors = FALSE;
+			return;
+		}
+		timer_bh_run(worker);
+	}
+}
+#endif
+
+/* This function starts the bottom-half worker threads, where the port has threads
+* Returns FALSE if creating one of them failed
+*/
+BOOL timer_bh_start()
+{
+#if TMR_BH_THREADS
+	if (!port_event_create(&timer_bh_started_event, FALSE))
+		return FALSE;
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++) {
+		timer_bh_next_worker = worker;
+		if (!port_event_create(&timer_bh_workers[worker].wake_event, FALSE) ||
+			!port_thread_create(&timer_bh_workers[worker].h_thread, timer_bh_thread, TRUE) ||
+			!port_event_wait(&timer_bh_started_event, PORT_WAIT_FOREVER))
+			return FALSE;
+	}
+#endif
+	return TRUE;
+}
+
+/* Snapshots - the timer state is written by the ISRs only, which make timer_state_seq odd while they run and even
+* again when they are done, like a seqlock. timer_snapshot copies the state and tries again if the sequence was odd
+* or moved meanwhile, so a consistent copy never makes the ISR wait for the reader.
+*/
+volatile uint32 timer_state_seq = 0;
+uint64 timer_fires_total = 0; // Fires of all timers since the start
+
+// This function starts an ISR's changes to the timer state, snapshots taken until timer_state_write_end are retried
+void timer_state_write_begin()
+{
+	timer_state_seq++;
+	port_release_barrier(); // The odd sequence must be visible before any change
+}
+
+void timer_state_write_end()
+{
+	port_release_barrier(); // Every change must be visible before the even sequence
+	timer_state_seq++;
+}
+
+/* This function fires the first expired_num timers of timer_expired[] - reloads the periodic ones one interval
+* after their previous deadline and deactivates the one-shot ones, the other timers are not touched, and dispatches
+* their callbacks.
+* Periods follow the deadlines and not the time the interrupt ran at, so interrupt latency does not add up into drift.
+* A timer that fell one or more whole periods behind skips them and counts them in timer_overruns, rather than
+* firing once per interrupt until it caught up.
+* With TMR_BH_WORKERS the statistics and callbacks are queued to the bottom-half workers instead.
+*/
+void fire_expired_timers(uint32 current_timer_value, uint32 expired_num)
+{
+	timer_fires_total += expired_num;
+	for (uint32 i = 0; i < expired_num; i++) {
+		timer_id_t timer_id = timer_expired[i];
+		uint32 late_us = timer_late_us(timer_id, current_timer_value);
+#if TMR_BH_WORKERS > 0
+		timer_bh_push(timer_id, late_us);
+#else
+		stats_record_fire(timer_id, late_us);
+#endif
+		trace_record(TMR_TRACE_FIRE, timer_id, current_timer_value, 0, 0);
+		timer_times_fired[timer_id]++;
+		if (timer_mode[timer_id] == TMR_MODE_ONE_SHOT)
+			continue; // Already out of the queue, deactivated right before its callback
+
+		if (timer_long_wait_us[timer_id] != 0) {
+			// Long timers go back to the overflow list, with the same overrun handling in 64 bits
+			uint64 now = TIMER_EXTEND(current_timer_value);
+			uint64 expiry = timer_expiry64[timer_id];
+			uint64 long_wait_us = timer_long_wait_us[timer_id];
+			if (now > expiry) {
+				uint64 missed = (now - expiry) / long_wait_us;
+				timer_overruns[timer_id] += (uint32)missed;
+				expiry += missed * long_wait_us;
+			}
+			timer_expiry64[timer_id] = expiry + long_wait_us;
+			hw_channel_release(timer_id);
+			overflow_park(timer_id);
+			continue;
+		}
+		uint32 deadline = timer_deadline[timer_id];
+		uint32 wait_us = timer_wait_us[timer_id];
+		if (deadline - current_timer_value > timer_slack_us[timer_id]) {
+			// Fired after its hard expiry, not ahead of it by slack
+			uint32 missed = (current_timer_value - deadline) / wait_us;
+			timer_overruns[timer_id] += missed;
+			deadline += missed * wait_us;
+		}
+		timer_deadline[timer_id] = deadline + wait_us; // After the current timer value
+		if (hw_channel_of(timer_id) == 0)
+			queue_insert(timer_id); // Channel timers stay on their channels
+	}
+
+	// All timers that expired on this tick are dispatched as one batch, with the queue already consistent
+	for (uint32 i = 0; i < expired_num; i++) {
+		timer_id_t timer_id = timer_expired[i];
+
+		// An earlier callback of the batch may have removed the timer
+		if (!TIMER_IS_ACTIVE(timer_id))
+			continue;
+
+		// The callback may set a one-shot timer again, so it is disarmed first
+		timer_callback_t callback = timer_callbacks[timer_id];
+		if (timer_mode[timer_id] == TMR_MODE_ONE_SHOT)
+			disarm_timer(timer_id);
+		if (callback.cb != NULL && TMR_BH_WORKERS == 0)
+			callback.cb(timer_id, callback.cb_ctx);
+		//printf("Firing timer id = %d\n", timer_id);
+	}
+}
+
+/* This function finds the next deadline of the shards whose queue changed, sets the next queue interrupt from the
+* earliest of all shards, and sets the dedicated channels to the deadlines of their timers
+*/
+void program_timer_interrupts()
+{
+	uint32 min_remain = 0xffffffff;
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++) {
+		timer_shard_t* p_shard = &timer_shards[shard];
+		if ((timer_shards_changed >> shard) & 1) {
+			uint32 shard_remain = find_minimal_remain(shard);
+			p_shard->has_deadline = shard_remain != 0xffffffff;
+			p_shard->next_deadline = last_update_timer_value + shard_remain;
+		}
+		if (p_shard->has_deadline && p_shard->next_deadline - last_update_timer_value < min_remain)
+			min_remain = p_shard->next_deadline - last_update_timer_value;
+	}
+	timer_shards_changed = 0;
+
+	// Set the next interrupt, a far deadline just gets an extra interrupt half way
+	if (min_remain > TMR_MAX_CMP_DISTANCE)
+		min_remain = TMR_MAX_CMP_DISTANCE;
+	tmr_channels[0].cmp_reg = last_update_timer_value + min_remain;
+
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if ((hw_channels_used >> channel) & 1) {
+			tmr_channels[channel].cmp_reg = timer_deadline[channel_timer[channel]];
+			tmr_channels[channel].en_reg = 1;
+		}
+		else
+			tmr_channels[channel].en_reg = 0;
+	}
+}
+
+/* This function moves last_update_timer_value and last_update_time64 forward to current_timer_value, unless a timer
+* is already due - then the base stays put until timer_interrupt fires it. timer_interrupt runs it before applying
+* the commands, so the first timer, or one set after an idle stretch, is measured from the current timer value and
+* its deadline key can't wrap around a stale base.
+*/
+void timer_rebase(uint32 current_timer_value)
+{
+	// A shard whose queue changed since its next deadline was found may have one due, it is left for the interrupt
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	if (timer_shards_changed != 0)
+		return;
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++) {
+		if (timer_shards[shard].has_deadline && timer_shards[shard].next_deadline - last_update_timer_value <= elapsed)
+			return;
+	}
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if (((hw_channels_used >> channel) & 1) && DEADLINE_KEY(channel_timer[channel]) <= elapsed)
+			return;
+	}
+	last_update_time64 = TIMER_EXTEND(current_timer_value);
+	last_update_timer_value = current_timer_value;
+}
+
+/* Timer interrupt callback function. The interrupt is configured as a Level in the CPU.
+* It fires up to timer_fire_budget queued timers. When more are due, the state is only updated up to the earliest
+* of them, which stays queued and is fired by the next interrupt - raised by software from here, or by a bottom-half
+* worker once it has made room - so the interrupt's time is bounded however many timers expire at once.
+*/
+void timer_interrupt(void) {
+
+	uint64 isr_start = stats_isr_begin();
+	timer_state_write_begin();
+	uint32 current_timer_value = tmr_val_reg;
+	timer_rebase(current_timer_value);
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	uint32 update_elapsed = elapsed; // How far last_update_timer_value moves, short of the timers left due
+	uint32 budget = timer_fire_budget();
+	BOOL timers_left = FALSE; // Due timers stay queued for the next interrupt
+	uint32 expired_num = 0;
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++) {
+		timer_shard_t* p_shard = &timer_shards[shard];
+
+		// Apply the commands queued by set_timer/remove_timer since the last interrupt
+		drain_timer_cmds(p_shard, current_timer_value);
+
+		// A shard without new commands is left alone until its next deadline
+		if (!((timer_shards_changed >> shard) & 1) &&
+			(!p_shard->has_deadline || p_shard->next_deadline - last_update_timer_value > elapsed))
+			continue;
+
+		// Take every timer whose deadline has passed out of the queue
+		expired_num += queue_collect_expired(shard, current_timer_value, &timer_expired[expired_num], budget - expired_num);
+		timer_shards_changed |= 1ULL << shard;
+
+		// The budget is used up - the shard may have timers left due, the update must not pass them
+		if (expired_num == budget) {
+			uint32 shard_remain = find_minimal_remain(shard);
+			if (shard_remain <= elapsed)
+				timers_left = TRUE;
+			if (shard_remain < update_elapsed)
+				update_elapsed = shard_remain;
+		}
+	}
+
+	// Channel timers whose channel interrupt hasn't run yet are fired here, so none is ever behind the new update.
+	// Without room for their fires they stay on their channels, and so does the update
+	if (budget != 0)
+		expired_num += hw_channels_collect_expired(current_timer_value, &timer_expired[expired_num]);
+	else {
+		for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+			if (((hw_channels_used >> channel) & 1) && DEADLINE_KEY(channel_timer[channel]) <= elapsed) {
+				timers_left = TRUE;
+				if (DEADLINE_KEY(channel_timer[channel]) < update_elapsed)
+					update_elapsed = DEADLINE_KEY(channel_timer[channel]);
+			}
+		}
+	}
+
+	// Timers fired ahead of their hard expiry share this interrupt instead of raising their own
+	for (uint32 i = 0; i < expired_num; i++) {
+		if (DEADLINE_KEY(timer_expired[i]) > elapsed)
+			timer_interrupts_saved++;
+	}
+
+	// Array was updated - save timer value
+	last_update_time64 = TIMER_EXTEND(last_update_timer_value + update_elapsed);
+	last_update_timer_value += update_elapsed;
+	overflow_unpark_due();
+
+	fire_expired_timers(current_timer_value, expired_num);
+	hw_channels_schedule();
+	program_timer_interrupts();
+	timer_bh_wake();
+
+	// The fires are dispatched and the next interrupt is set, now the cancelled timers are swept out
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++)
+		queue_compact(shard);
+	stats_isr_end(&timer_isr_stats, isr_start, expired_num);
+
+	// The timers left due are fired by the next interrupt
+	if (timers_left) {
+		if (budget < TMR_ISR_FIRE_CAP)
+			timer_bh_stalls++; // The worker that makes room raises it
+		else {
+			timer_isr_capped++;
+			tmr_swi_reg = 1;
+		}
+	}
+	timer_state_write_end();
+
+	// End of interrupt - clear
+	tmr_channels[0].clr_reg = 1;
+	HW_TIMER_REG_WRITTEN();
+}
+
+/* Dedicated channel interrupt callback function - fires the timer the channel holds together with the other
+* channel timers that are due by their slack, the timer queue is not walked.
+* The compare value may have matched for a timer that has since left the channel or was fired by timer_interrupt.
+*/
+void timer_channel_interrupt(uint32 channel)
+{
+	uint64 isr_start = stats_isr_begin();
+	timer_state_write_begin();
+	uint32 current_timer_value = tmr_val_reg;
+	uint32 elapsed = current_timer_value - last_update_timer_value;
+	uint32 expired_num = 0;
+	if (timer_fire_budget() != 0)
+		expired_num = hw_channels_collect_expired(current_timer_value, timer_expired); // Otherwise the worker that makes room raises timer_interrupt
+	for (uint32 i = 0; i < expired_num; i++) {
+		if (DEADLINE_KEY(timer_expired[i]) > elapsed)
+			timer_interrupts_saved++;
+	}
+	fire_expired_timers(current_timer_value, expired_num);
+
+	// The reloaded timers may no longer be the nearest
+	hw_channels_schedule();
+	program_timer_interrupts();
+	timer_bh_wake();
+	timer_state_write_end();
+	stats_isr_end(&channel_isr_stats, isr_start, expired_num);
+
+	// End of interrupt - clear
+	tmr_channels[channel].clr_reg = 1;
+	HW_TIMER_REG_WRITTEN();
+}
+
+/*This function closes the simulation's and the bottom-half workers' threads and events
+Returns FALSE if closing any of them failed*/
+BOOL close_handles()
+{
+	BOOL no_errors = TRUE;
+#if TMR_PORT_HOSTED
+	// close the hw timer and isr threads, and the interrupt and wake events
+	no_errors = port_thread_close(&h_hw_timer) && no_errors;
+	no_errors = port_thread_close(&h_isr) && no_errors;
+	no_errors = port_event_close(&irq_event) && no_errors;
+	no_errors = port_event_close(&hw_wake_event) && no_errors;
+#endif
+#if TMR_BH_THREADS
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++) {
+		no_errors = port_thread_close(&timer_bh_workers[worker].h_thread) && no_errors;
+		no_errors = port_event_close(&timer_bh_workers[worker].wake_event) && no_errors;
+	}
+	no_errors = port_event_close(&timer_bh_started_event) && no_errors;
+#endif
+	return no_errors;
+}
+
+// This function handling the finish program routine - closing handles
+void finish_program_routine()
+{
+	if (!close_handles())
+	{ // closing failed
+		printf("ERROR: Closing the simulation threads and events failed\n");
+		g_no_errors = FALSE;
+	}
+	if (g_no_errors == FALSE)
+	{ // if an error occurred during the program - exit with 1
+		exit(1);
+	}
+}
+
+/* This function deactivates a timer.
+* The timer is removed by the next timer interrupt, which this call raises. Must be called from the set_timer thread.
+* The active bit belongs to the interrupt, which may not have applied a set queued before - so the command is queued
+* whether the timer looks active or not, and removing an inactive timer does nothing.
+* Returns FALSE if the timer ID is invalid or the command queue is full
+*/
+BOOL remove_timer(timer_id_t timer_id)
+{
+	// input Timer ID exceeds limit
+	if (timer_id >= TMR_NUM) {
+		printf("ERROR: Timer ID exceeds limit, maximal is: %d\n", TMR_NUM - 1);
+		return FALSE;
+	}
 
-typedef struct {
-	uint32 wait_us; // The constant time interval of the timer
-	uint32 remain; // The remaining time until next interrupt
-	uint32 times_fired; // The number of times the timer fired
-} timer_data_t;
-
-volatile uint32 tmr_val_reg = 0; // Read-Only register - current uint32 timer value
-volatile uint32 tmr_cmp_reg = 0; // Write-Only register - uint32 timer interrupt compare value
-volatile uint32 tmr_clr_reg = 0; // Write-Only uint32 register - write any value to clear interrupt
-HANDLE h_hw_timer = NULL; // hw timer thread handle
-HANDLE h_isr = NULL; // isr thread handle
-DWORD hw_timer_tid; // hw timer thread ID (tid)
-BOOL g_no_errors = TRUE; // Indicates an error that leads to finishing the program
-timer_data_t timer_data[TMR_NUM] = { 0 }; // For inactive timer entries: wait_us==0, remain==0
-uint32 last_update_timer_value = 0; /*The timer value of the last time the timer_data array was updated. 
-									Initialized with 0, the real value will be set in the first set_timer call*/
+	// Deactivate timer
+	timer_cmd_t cmd = { TMR_CMD_REMOVE, timer_id, 0, 0, tmr_val_reg, 0, NULL, NULL, 0 };
+	return push_timer_cmd(&cmd);
+}
 
+/* Timer ID allocation for callers that don't manage IDs themselves.
+* Each shard's IDs are owned by the thread bound to it, like the shard's command ring producer side.
+* The summary of full words makes finding a free ID a pair of bit scans.
+*/
+#define TIMER_IS_ALLOCATED(timer_id) \
+	((timer_shards[TIMER_SHARD(timer_id)].allocated[(timer_id) % TMR_SHARD_TIMERS / 64] >> ((timer_id) % 64)) & 1)
 
-// A function that finds minimal remain
-uint32 find_minimal_remain() {
-	uint32 minimal_rem = 0xffffffff; // just an initial minimal_rem to begin with
-	for (int i = 0; i < TMR_NUM; i++) {
-		// Skip inactive timer entries
-		if (timer_data[i].wait_us == 0)
+/* This function hands out a free timer ID of the calling thread's shard to use with set_timer/set_timer_cb
+* Returns TMR_INVALID_ID if all IDs of the shard are taken
+*/
+timer_id_t alloc_timer_id()
+{
+	timer_shard_t* p_shard = &timer_shards[timer_thread_shard];
+	for (uint32 summary_word = 0; summary_word < TMR_SUMMARY_WORDS; summary_word++) {
+		uint64 not_full = ~p_shard->alloc_full[summary_word];
+		if (not_full == 0)
 			continue;
 
-		// Update minimal if necessary
-		uint32 rem_i = timer_data[i].remain;
-		if (rem_i < minimal_rem)
-			minimal_rem = rem_i;
+		// The padding IDs past TMR_NUM are never handed out, so the last word is never marked full
+		uint32 word = summary_word * 64 + bit_scan_forward64(not_full);
+		if (word >= TMR_SHARD_WORDS)
+			break;
+		uint32 bit = bit_scan_forward64(~p_shard->allocated[word]);
+		timer_id_t timer_id = timer_thread_shard * TMR_SHARD_TIMERS + word * 64 + bit;
+		if (timer_id >= TMR_NUM)
+			break;
+
+		p_shard->allocated[word] |= 1ULL << bit;
+		if (p_shard->allocated[word] == ~0ULL)
+			p_shard->alloc_full[summary_word] |= 1ULL << (word % 64);
+		return timer_id;
 	}
-	return minimal_rem;
+
+	printf("ERROR: All timer IDs are taken\n");
+	return TMR_INVALID_ID;
 }
 
-// A function that sets a new timer
-void set_timer(uint8 timer_id, uint32 wait_us) {
+/* This function deactivates a timer handed out by alloc_timer_id and makes its ID free again
+* Returns FALSE if the ID was not allocated or the command queue is full
+*/
+BOOL free_timer_id(timer_id_t timer_id)
+{
+	if (timer_id >= TMR_NUM || !TIMER_IS_ALLOCATED(timer_id)) {
+		printf("ERROR: Timer ID is not allocated\n");
+		return FALSE;
+	}
 
-	// input Timer ID exceeds limit
-	if (timer_id >= TMR_NUM) {
-		printf("ERROR: Timer ID exceeds limit, maximal is: %d\n", TMR_NUM-1);
-		return NULL;
+	// The remove command is applied before any later set of the same ID
+	timer_cmd_t cmd = { TMR_CMD_REMOVE, timer_id, 0, 0, tmr_val_reg, 0, NULL, NULL, 0 };
+	if (!push_timer_cmd(&cmd))
+		return FALSE;
+
+	timer_shard_t* p_shard = &timer_shards[TIMER_SHARD(timer_id)];
+	uint32 word = timer_id % TMR_SHARD_TIMERS / 64;
+	p_shard->allocated[word] &= ~(1ULL << (timer_id % 64));
+	p_shard->alloc_full[word / 64] &= ~(1ULL << (word % 64));
+	return TRUE;
+}
+
+/* Timer handles.
+* A handle pairs a timer ID with the generation of the ID, destroying the timer bumps the generation so handles
+* kept after sw_timer_destroy are detected. The IDs come from alloc_timer_id, so there are TMR_NUM handles at most
+* like there are TMR_NUM timers - the generations are one more array of the timer state, and no handle function
+* allocates memory.
+*/
+uint32 timer_generation[TMR_NUM] = { 0 }; // Generation of the current or next handle of each ID
+
+/* This function creates a timer and returns its handle, the timer is inactive until sw_timer_set
+* Returns TMR_INVALID_HANDLE if all timer IDs are taken
+*/
+timer_handle_t sw_timer_create()
+{
+	timer_id_t timer_id = alloc_timer_id();
+	if (timer_id == TMR_INVALID_ID)
+		return TMR_INVALID_HANDLE;
+
+	if (timer_generation[timer_id] == 0)
+		timer_generation[timer_id] = 1; // First use of the ID, or its generation wrapped around
+	return ((timer_handle_t)timer_generation[timer_id] << 32) | timer_id;
+}
+
+/* This function returns the timer ID of a handle
+* Returns TMR_INVALID_ID if the handle is invalid or its timer was destroyed
+*/
+timer_id_t timer_handle_to_id(timer_handle_t handle)
+{
+	timer_id_t timer_id = (timer_id_t)handle;
+	uint32 generation = (uint32)(handle >> 32);
+	if (timer_id >= TMR_NUM || generation == 0 || timer_generation[timer_id] != generation || !TIMER_IS_ALLOCATED(timer_id)) {
+		printf("ERROR: Invalid or stale timer handle\n");
+		return TMR_INVALID_ID;
 	}
+	return timer_id;
+}
 
-	// Assign values of the new timer
-	timer_data[timer_id].wait_us = wait_us;
-	timer_data[timer_id].remain = wait_us;
-	timer_data[timer_id].times_fired = 0;
+/* This function arms the timer of a handle, see set_timer_cb
+* Returns FALSE if the handle is invalid or stale, or the command queue is full
+*/
+BOOL sw_timer_set(timer_handle_t handle, uint32 wait_us, timer_cb_t cb, void* cb_ctx)
+{
+	timer_id_t timer_id = timer_handle_to_id(handle);
+	if (timer_id == TMR_INVALID_ID)
+		return FALSE;
+	return set_timer_cb(timer_id, wait_us, cb, cb_ctx);
+}
 
-	// Read current timer value so all updates are relative to this time
-	uint32 current_timer_value = tmr_val_reg;
+/* This function deactivates the timer of a handle, the handle stays valid
+* Returns FALSE if the handle is invalid or stale, or the command queue is full
+*/
+BOOL sw_timer_cancel(timer_handle_t handle)
+{
+	timer_id_t timer_id = timer_handle_to_id(handle);
+	if (timer_id == TMR_INVALID_ID)
+		return FALSE;
+	return remove_timer(timer_id);
+}
 
-	// Update all the timers' remain values with respect to current time
-	// In the first call, last_update_timer_value is 0, but all entries are skipped so we don't
-	// actually use it before we have a real value
-	uint32 time_diff = current_timer_value - last_update_timer_value;
-	for (int i = 0; i < TMR_NUM; i++) {
-		// No need to update the new timer
-		if (timer_id == i)
-			continue;
+/* This function deactivates the timer of a handle and frees it, the handle and its copies become stale
+* Returns FALSE if the handle is invalid or stale, or the command queue is full
+*/
+BOOL sw_timer_destroy(timer_handle_t handle)
+{
+	timer_id_t timer_id = timer_handle_to_id(handle);
+	if (timer_id == TMR_INVALID_ID || !free_timer_id(timer_id))
+		return FALSE;
+	timer_generation[timer_id]++;
+	return TRUE;
+}
 
-		// Skip inactive timer entries
-		if (timer_data[i].wait_us == 0)
-			continue;
+// One active timer of a snapshot
+typedef struct {
+	timer_id_t timer_id;
+	timer_mode_t mode;
+	uint64 wait_us; // The interval of a periodic timer, the timeout of a one-shot timer - of long timers too
+	uint32 slack_us;
+	uint64 remain_us; // Until the hard expiry, from the snapshot's time - 0 once the timer is due
+	uint32 times_fired;
+	uint32 overruns;
+} timer_snapshot_entry_t;
 
-		timer_data[i].remain -= time_diff;
+// The aggregate of a snapshot - cheap to take however many timers there are
+typedef struct {
+	uint64 time64; // The extended timer value the snapshot was taken at, see timer_now64
+	uint32 active_num; // Active timers
+	uint32 slack_num; // Active timers with a non-zero slack
+	uint64 next_deadline64; // When the engine next has a timer due or a wheel level to cascade, TMR_NO_DEADLINE for never
+	uint64 fires_total; // Fires of all timers since the start
+	uint32 interrupts_saved; // See timer_interrupts_saved
+} timer_aggregate_t;
+
+// This function reads the aggregate at the timer value current_timer_value - only inside timer_snapshot's read section
+void snapshot_read_aggregate(timer_aggregate_t* p_aggregate, uint32 current_timer_value)
+{
+	p_aggregate->time64 = TIMER_EXTEND(current_timer_value);
+	p_aggregate->active_num = timer_active_num;
+	p_aggregate->slack_num = timer_slack_num;
+	p_aggregate->fires_total = timer_fires_total;
+	p_aggregate->interrupts_saved = timer_interrupts_saved;
+
+	// The ISRs leave each shard's next deadline and the channels up to date, parked timers wait for overflow_next_unpark
+	uint64 min_remain = TMR_NO_DEADLINE;
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++) {
+		if (timer_shards[shard].has_deadline && timer_shards[shard].next_deadline - last_update_timer_value < min_remain)
+			min_remain = timer_shards[shard].next_deadline - last_update_timer_value;
 	}
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if (((hw_channels_used >> channel) & 1) && DEADLINE_KEY(channel_timer[channel]) < min_remain)
+			min_remain = DEADLINE_KEY(channel_timer[channel]);
+	}
+	uint64 next_deadline64 = min_remain == TMR_NO_DEADLINE ? TMR_NO_DEADLINE : last_update_time64 + min_remain;
+	if (overflow_next_unpark != ~0ULL && overflow_next_unpark + TMR_PARK_HORIZON < next_deadline64)
+		next_deadline64 = overflow_next_unpark + TMR_PARK_HORIZON;
+	p_aggregate->next_deadline64 = next_deadline64;
+}
 
-	// Array was updated - save timer value
-	last_update_timer_value = current_timer_value;
+// This function reads an active timer at the timer value current_timer_value - only inside timer_snapshot's read section
+void snapshot_read_timer(timer_id_t timer_id, uint32 current_timer_value, uint64 now, timer_snapshot_entry_t* p_entry)
+{
+	p_entry->timer_id = timer_id;
+	p_entry->mode = (timer_mode_t)timer_mode[timer_id];
+	p_entry->wait_us = timer_wait_us[timer_id];
+	p_entry->slack_us = timer_slack_us[timer_id];
+	p_entry->remain_us = timer_deadline[timer_id] - current_timer_value;
+	if (timer_long_wait_us[timer_id] != 0) {
+		// Long timers may be parked, their extended expiry is always up to date
+		p_entry->wait_us = timer_long_wait_us[timer_id];
+		p_entry->remain_us = timer_expiry64[timer_id] > now ? timer_expiry64[timer_id] - now : 0;
+	}
+	else if (DEADLINE_KEY(timer_id) <= current_timer_value - last_update_timer_value)
+		p_entry->remain_us = 0; // Overdue, the interrupt is about to handle it
+	p_entry->times_fired = timer_times_fired[timer_id];
+	p_entry->overruns = timer_overruns[timer_id];
+}
 
-	uint32 min_remain = find_minimal_remain(); // The minimal remain after setting the new timer
-	tmr_cmp_reg = current_timer_value + min_remain; // Next interrupt is min_remain from now
+/* This function copies the aggregate and, if p_entries isn't NULL, up to max_entries active timers in ID order,
+* as they were between two ISR runs, and sets *p_entries_num to the number of entries copied. The ISRs don't wait
+* for it - a copy they changed meanwhile is taken again. May be called from any thread, not from timer callbacks.
+* Returns FALSE if the ISRs changed the state during each of TMR_SNAPSHOT_RETRIES copies
+*/
+BOOL timer_snapshot(timer_aggregate_t* p_aggregate, timer_snapshot_entry_t* p_entries, uint32 max_entries, uint32* p_entries_num)
+{
+	for (uint32 attempt = 0; attempt < TMR_SNAPSHOT_RETRIES; attempt++) {
+		uint32 seq = timer_state_seq;
+		port_acquire_barrier(); // Read the state only after the sequence
+		if ((seq & 1) == 0) {
+			uint32 current_timer_value = tmr_val_reg;
+			snapshot_read_aggregate(p_aggregate, current_timer_value);
+			uint32 entries_num = 0;
+			if (p_entries != NULL) {
+				for (timer_id_t i = next_active_timer(0); i != TMR_INVALID_ID && entries_num < max_entries; i = next_active_timer(i + 1))
+					snapshot_read_timer(i, current_timer_value, p_aggregate->time64, &p_entries[entries_num++]);
+			}
+			port_acquire_barrier(); // Check the sequence only after the state was read
+			if (timer_state_seq == seq) {
+				if (p_entries_num != NULL)
+					*p_entries_num = entries_num;
+				return TRUE;
+			}
+		}
+		port_yield(); // Let the ISR finish
+	}
+	return FALSE;
 }
 
-// Timer interrupt callback function. The interrupt is configured as a Level in the CPU.
-void timer_interrupt(void) {
+// This function copies the aggregate only, see timer_snapshot
+BOOL timer_snapshot_aggregate(timer_aggregate_t* p_aggregate)
+{
+	return timer_snapshot(p_aggregate, NULL, 0, NULL);
+}
 
-	// Find the minimal remain as this is the current interrupt that's firing
-	uint32 min_remain = find_minimal_remain();
+// This function displays the aggregate of the timers in one line
+BOOL display_timer_summary()
+{
+	timer_aggregate_t aggregate;
+	if (!timer_snapshot_aggregate(&aggregate)) {
+		printf("ERROR: The timers kept changing while they were read\n");
+		return FALSE;
+	}
+	printf("Active timers: %u", aggregate.active_num);
+	if (aggregate.next_deadline64 != TMR_NO_DEADLINE)
+		printf(", Next deadline in: %llu us", aggregate.next_deadline64 > aggregate.time64 ? aggregate.next_deadline64 - aggregate.time64 : 0);
+	printf(", Times fired: %llu\n", aggregate.fires_total);
+	return TRUE;
+}
 
-	for (int i = 0; i < TMR_NUM; i++) {
-		// Skip inactive timer entries
-		if (timer_data[i].wait_us == 0)
-			continue;
+timer_snapshot_entry_t display_entries[TMR_NUM]; // display_timers' snapshot, too large for the stack
 
-		// Update remain of all timers
-		timer_data[i].remain -= min_remain;
+// This function displays active timers, from a snapshot
+void display_timers()
+{
+	timer_aggregate_t aggregate;
+	uint32 entries_num = 0;
+	if (!timer_snapshot(&aggregate, display_entries, TMR_NUM, &entries_num)) {
+		printf("ERROR: The timers kept changing while they were read\n");
+		return;
+	}
 
-		// The firing timers now have remain==0 so update them and print
-		if (timer_data[i].remain == 0) {
-			timer_data[i].remain = timer_data[i].wait_us;
-			timer_data[i].times_fired++;
-			//printf("Firing timer id = %d\n", i);
+	for (uint32 e = 0; e < entries_num; e++) {
+		const timer_snapshot_entry_t* p_entry = &display_entries[e];
+		timer_id_t i = p_entry->timer_id;
+		if (p_entry->mode == TMR_MODE_ONE_SHOT)
+			printf("Timer %u - One-shot: %llu us, Remain: %llu us\n", i, p_entry->wait_us, p_entry->remain_us);
+		else {
+			if (p_entry->slack_us != 0)
+				printf("Timer %u - Interval: %llu us, Slack: %u us, Remain: %llu us, Times fired: %u", i, p_entry->wait_us, p_entry->slack_us, p_entry->remain_us, p_entry->times_fired);
+			else
+				printf("Timer %u - Interval: %llu us, Remain: %llu us, Times fired: %u", i, p_entry->wait_us, p_entry->remain_us, p_entry->times_fired);
+			if (p_entry->overruns != 0)
+				printf(", Overruns: %u", p_entry->overruns);
+			printf("\n");
 		}
 	}
 
-	// Array was updated - save timer value
-	last_update_timer_value = tmr_val_reg;
+	if (entries_num == 0)
+		printf("All timers are inactive\n");
+	if (aggregate.interrupts_saved != 0)
+		printf("Interrupts saved by slack: %u\n", aggregate.interrupts_saved);
+}
 
-	// Set the next interrupt
-	min_remain = find_minimal_remain();
-	tmr_cmp_reg = last_update_timer_value + min_remain;
+#if TMR_STATS
+// This function prints the statistics of an ISR, with times converted at the port clock frequency clock_freq
+void print_isr_stats(const char* name, const isr_stats_t* p_stats, uint64 clock_freq)
+{
+	uint64 calls = p_stats->calls;
+	if (calls == 0) {
+		printf("%s - Calls: 0\n", name);
+		return;
+	}
+	double us_per_tick = 1e6 / (double)clock_freq;
+	printf("%s - Calls: %llu, Time avg: %.2f us, max: %.2f us, Timers fired avg: %.2f, max: %u, Active timers avg: %.1f, max: %u\n",
+		name, calls, (double)p_stats->clock_total * us_per_tick / (double)calls, (double)p_stats->clock_max * us_per_tick,
+		(double)p_stats->fired_total / (double)calls, p_stats->fired_max, (double)p_stats->active_total / (double)calls, p_stats->active_max);
+}
 
-	// End of interrupt - clear
-	tmr_clr_reg = 1;
+// This function prints the non-empty buckets of a lateness histogram
+void print_late_hist(const uint64* hist)
+{
+	printf("All timers - Fires late by:");
+	const char* separator = " ";
+	for (uint32 bucket = 0; bucket < TMR_LATE_BUCKETS; bucket++) {
+		if (hist[bucket] == 0)
+			continue;
+		if (bucket <= 1)
+			printf("%s%u us: %llu", separator, bucket, hist[bucket]);
+		else if (bucket == TMR_LATE_BUCKETS - 1)
+			printf("%s%u+ us: %llu", separator, 1u << (bucket - 1), hist[bucket]);
+		else
+			printf("%s%u-%u us: %llu", separator, 1u << (bucket - 1), (1u << bucket) - 1, hist[bucket]);
+		separator = ", ";
+	}
+	printf("\n");
+}
+#endif
 
-	return 0;
+/* This function prints the ISR statistics, the fire lateness histogram of all timers together, and the fires and
+* maximal lateness of each active timer that fired since it was set
+*/
+void display_timer_stats()
+{
+#if TMR_STATS
+	uint64 clock_freq = port_clock_freq();
+	print_isr_stats("Queue interrupt", &timer_isr_stats, clock_freq);
+	if (TMR_HW_CHANNELS > 1)
+		print_isr_stats("Channel interrupts", &channel_isr_stats, clock_freq);
+	if (timer_isr_capped != 0)
+		printf("Interrupts that fired %u timers and left the rest to the next one: %llu\n", TMR_ISR_FIRE_CAP, timer_isr_capped);
+#if TMR_BH_WORKERS > 0
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++) {
+		timer_bh_worker_t* p_worker = &timer_bh_workers[worker];
+		printf("Bottom-half worker %u - Fires run: %llu, Queued: %u\n", worker, p_worker->fires_run, p_worker->fire_head - p_worker->fire_tail);
+	}
+	printf("Interrupts stalled for fire ring room: %llu\n", timer_bh_stalls);
+#endif
+#if TMR_BACKEND == TMR_BACKEND_HEAP && TMR_LAZY_CANCEL
+	uint64 tombstones = 0;
+	for (uint32 shard = 0; shard < TMR_SHARDS; shard++)
+		tombstones += heap_tombstones[shard];
+	printf("Cancelled timers left in the heap: %llu, swept out: %llu, full heaps rebuilt: %llu\n", tombstones,
+		heap_tombstones_swept, heap_rebuilds);
+#endif
+
+	uint64 all_hist[TMR_LATE_BUCKETS] = { 0 };
+	for (uint32 writer = 0; writer < TMR_STATS_WRITERS; writer++)
+		for (uint32 bucket = 0; bucket < TMR_LATE_BUCKETS; bucket++)
+			all_hist[bucket] += timer_late_hist[writer][bucket];
+	print_late_hist(all_hist);
+	printf("Maximal lateness: %u us\n", timer_late_max);
+
+	for (timer_id_t i = next_active_timer(0); i != TMR_INVALID_ID; i = next_active_timer(i + 1)) {
+		if (timer_times_fired[i] != 0)
+			printf("Timer %u - Fires: %u, Maximal lateness: %u us\n", i, timer_times_fired[i], timer_late_max_us[i]);
+	}
+#else
+	printf("Statistics are not built in, build with TMR_STATS 1\n");
+#endif
 }
 
-/* The function creates a thread
-* Parameters: thread's start routine, thread id and the thread argument
-* Returns a thread handle
+/* This function writes the statistics to a file as CSV, for tools to read. The lines are
+* isr,<queue|channel>,<calls>,<total ns>,<max ns>,<timers fired>,<max timers fired>,<sum of active timers>,<max active timers>
+* late,<TMR_LATE_BUCKETS histogram buckets of all fires, as in timer_late_hist>
+* timer,<timer ID>,<fires since set>,<maximal lateness since set in us>
+* with a timer line for each timer that fired since it was set, active or not.
+* Returns FALSE if the file can't be written or the statistics are not built in
 */
-HANDLE create_thread_simple(LPTHREAD_START_ROUTINE p_start_routine, LPDWORD p_thread_id)
+BOOL dump_timer_stats(const char* path)
 {
-	if (NULL == p_start_routine)
-	{ // If thread has no start routine
-		printf("ERROR: Error when creating a thread\n");
-		printf("Received null pointer\n");
-		return NULL;
+#if TMR_STATS
+	FILE* p_file = port_fopen(path, "w");
+	if (p_file == NULL) {
+		printf("ERROR: Can't open %s for writing\n", path);
+		return FALSE;
+	}
+
+	uint64 clock_freq = port_clock_freq();
+	const isr_stats_t* isr_stats[] = { &timer_isr_stats, &channel_isr_stats };
+	const char* isr_names[] = { "queue", "channel" };
+	for (int i = 0; i < 2; i++) {
+		const isr_stats_t* p_stats = isr_stats[i];
+		fprintf(p_file, "isr,%s,%llu,%.0f,%.0f,%llu,%u,%llu,%u\n", isr_names[i], p_stats->calls,
+			(double)p_stats->clock_total * 1e9 / (double)clock_freq, (double)p_stats->clock_max * 1e9 / (double)clock_freq,
+			p_stats->fired_total, p_stats->fired_max, p_stats->active_total, p_stats->active_max);
+	}
+
+	fprintf(p_file, "late");
+	for (uint32 bucket = 0; bucket < TMR_LATE_BUCKETS; bucket++) {
+		uint64 fires = 0;
+		for (uint32 writer = 0; writer < TMR_STATS_WRITERS; writer++)
+			fires += timer_late_hist[writer][bucket];
+		fprintf(p_file, ",%llu", fires);
+	}
+	fprintf(p_file, "\n");
+
+	for (timer_id_t i = 0; i < TMR_NUM; i++) {
+		if (timer_times_fired[i] != 0)
+			fprintf(p_file, "timer,%u,%u,%u\n", i, timer_times_fired[i], timer_late_max_us[i]);
 	}
 
-	return CreateThread(
-		NULL,            /*  default security attributes */
-		0,               /*  use default stack size */
-		p_start_routine, /*  thread function */
-		NULL,/*  argument to thread function */
-		0,               /*  use default creation flags */
-		p_thread_id);    /*  returns the thread identifier */
+	BOOL written = !ferror(p_file);
+	if (fclose(p_file) != 0 || !written) {
+		printf("ERROR: Writing %s failed\n", path);
+		return FALSE;
+	}
+	return TRUE;
+#else
+	printf("ERROR: Statistics are not built in, build with TMR_STATS 1\n");
+	return FALSE;
+#endif
 }
 
-// This function closes one handle
-// Parameter: pointer to the handle
-void close_one_handle(HANDLE* handle, BOOL* no_errors)
+/* This function runs the ISR of every channel whose bit is set in irq_lines.
+* The ISR thread calls it on hosted ports, the board's interrupt vector of channel c calls it with 1 << c on bare metal
+*/
+void timer_irq_dispatch(uint32 irq_lines)
 {
-	if (*handle != NULL)
-	{
-		if (FALSE == CloseHandle(*handle))
-		{ // send thread closing failed
-			printf("ERROR: CloseHandle failed\n");
-			*no_errors = FALSE;
-			return;
+	// The dedicated channels come first, they hold the nearest deadlines
+	for (uint32 channel = 1; channel < TMR_HW_CHANNELS; channel++) {
+		if ((irq_lines >> channel) & 1)
+			timer_channel_interrupt(channel);
+	}
+	if (irq_lines & 1)
+		timer_interrupt();
+}
+
+#if TMR_PORT_HOSTED
+// State of the HW timer simulation between two of its steps
+typedef struct {
+	BOOL irq_pending[TMR_HW_CHANNELS]; // Compare match or software interrupt not delivered yet
+	BOOL isr_in_service[TMR_HW_CHANNELS]; // The channel's ISR has not written its clr_reg yet
+	uint32 prev_timer_value; // The counter value at the previous step
+	uint32 prev_cmp[TMR_HW_CHANNELS]; // The compare values at the previous step
+	BOOL prev_en[TMR_HW_CHANNELS]; // The compare enables at the previous step
+	uint32 start_timer_value; // The counter value at clock_start
+	uint64 clock_freq;
+	uint64 clock_start; // The port clock when the simulation started
+	uint64 elapsed_ticks; // HW timer ticks since clock_start, as of the last hw_timer_sim_clock call
+} hw_timer_sim_t;
+
+// This function starts simulating the HW timer from the current register values
+void hw_timer_sim_init(hw_timer_sim_t* p_sim)
+{
+	memset(p_sim, 0, sizeof(*p_sim));
+	p_sim->prev_timer_value = tmr_val_reg;
+	for (uint32 channel = 0; channel < TMR_HW_CHANNELS; channel++) {
+		p_sim->prev_cmp[channel] = tmr_channels[channel].cmp_reg;
+		p_sim->prev_en[channel] = tmr_channels[channel].en_reg != 0;
+	}
+	p_sim->start_timer_value = tmr_val_reg;
+	p_sim->clock_freq = port_clock_freq();
+	p_sim->clock_start = port_clock();
+}
+
+// Converts a port clock interval to HW timer ticks without overflowing the intermediate product
+uint64 clock_to_timer_ticks(uint64 clock_ticks, uint64 clock_freq)
+{
+	return clock_ticks / clock_freq * TMR_FREQ_HZ + clock_ticks % clock_freq * TMR_FREQ_HZ / clock_freq;
+}
+
+// Converts HW timer ticks to a port clock interval, rounded up so the counter has reached them by its end
+uint64 timer_ticks_to_clock(uint64 timer_ticks, uint64 clock_freq)
+{
+	return timer_ticks / TMR_FREQ_HZ * clock_freq + (timer_ticks % TMR_FREQ_HZ * clock_freq + TMR_FREQ_HZ - 1) / TMR_FREQ_HZ;
+}
+
+// This function advances tmr_val_reg - derived from the elapsed time, so it doesn't drift however late it is called
+void hw_timer_sim_clock(hw_timer_sim_t* p_sim)
+{
+#if TMR_SIM_CLOCK != TMR_SIM_CLOCK_STEP
+	p_sim->elapsed_ticks = clock_to_timer_ticks(port_clock() - p_sim->clock_start, p_sim->clock_freq);
+	tmr_val_reg = p_sim->start_timer_value + (uint32)p_sim->elapsed_ticks;
+#else
+	p_sim->elapsed_ticks++;
+	tmr_val_reg++;
+#endif
+	//printf("hw timer increased by 1, tmr_val_reg = %d\n", tmr_val_reg);
+}
+
+/* This function looks at the registers once, like the HW timer does every tick.
+* Returns the interrupt lines to raise - bit c for channel c
+*/
+uint32 hw_timer_sim_step(hw_timer_sim_t* p_sim)
+{
+	uint32 timer_value = tmr_val_reg;
+	uint32 irq_lines = 0;
+	for (uint32 channel = 0; channel < TMR_HW_CHANNELS; channel++) {
+		hw_timer_channel_t* p_channel = &tmr_channels[channel];
+
+		// Compare match (value >= compare) - the compare value was passed since the previous step,
+		// possibly by several ticks at once, or a newly written or enabled compare value is already due
+		uint32 cmp = p_channel->cmp_reg;
+		BOOL en = p_channel->en_reg != 0;
+		if (en && (cmp - p_sim->prev_timer_value - 1 < timer_value - p_sim->prev_timer_value ||
+			((cmp != p_sim->prev_cmp[channel] || !p_sim->prev_en[channel]) && (int32)(timer_value - cmp) >= 0)))
+			p_sim->irq_pending[channel] = TRUE;
+		p_sim->prev_cmp[channel] = cmp;
+		p_sim->prev_en[channel] = en;
+
+		if (channel == 0 && tmr_swi_reg) {
+			tmr_swi_reg = 0;
+			p_sim->irq_pending[channel] = TRUE;
+		}
+		if (p_channel->clr_reg) {
+			p_channel->clr_reg = 0;
+			p_sim->isr_in_service[channel] = FALSE;
+		}
+
+		// Only one ISR per channel runs at a time, the next one is raised after the current one cleared the interrupt
+		if (p_sim->irq_pending[channel] && !p_sim->isr_in_service[channel]) {
+			p_sim->irq_pending[channel] = FALSE;
+			p_sim->isr_in_service[channel] = TRUE;
+			irq_lines |= 1 << channel;
 		}
-		*handle = NULL;
 	}
+	p_sim->prev_timer_value = timer_value;
+	return irq_lines;
 }
 
-/*This function closes thread handles
-Parameters: thread handles array*/
-void close_handles(HANDLE* thread_handle)
+/* This function returns the HW timer ticks until the earliest compare value is due, 0xffffffffffffffff if no channel
+* can interrupt. Channels with an interrupt waiting for the ISR to clear only await the clear
+*/
+uint64 hw_timer_sim_ticks_to_cmp(const hw_timer_sim_t* p_sim)
 {
-	// close hw timer thread handle
-	close_one_handle(thread_handle, &g_no_errors);
+	uint32 timer_value = tmr_val_reg;
+	uint64 ticks_to_cmp = 0xffffffffffffffffULL;
+	for (uint32 channel = 0; channel < TMR_HW_CHANNELS; channel++) {
+		if (tmr_channels[channel].en_reg != 0 && !p_sim->irq_pending[channel] && (uint32)(tmr_channels[channel].cmp_reg - timer_value) < ticks_to_cmp)
+			ticks_to_cmp = (uint32)(tmr_channels[channel].cmp_reg - timer_value);
+	}
+	return ticks_to_cmp;
 }
 
-/* This function handling the finish program routine - closing handles
-* Parameter: thread handles array
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+/* Event loop mode - no simulation threads. The HW timer is simulated on the application's thread: a timerfd is armed to
+* the earliest compare value (or to now, for a software interrupt), and the application calls timer_event_loop_dispatch
+* from its epoll loop when the fd is readable, which runs the ISRs inline. Timers must be set on the same thread.
+*/
+hw_timer_sim_t event_loop_sim;
+int event_loop_fd = -1; // The timerfd, -1 before timer_event_loop_open
+uint32 event_loop_irq_lines = 0; // Interrupts raised but not dispatched yet
+BOOL event_loop_dispatching = FALSE; // The ISRs are running, the fd is armed once they are done
+
+/* This function starts the HW timer simulation and returns the fd to poll for readability (EPOLLIN)
+* Returns -1 if the timerfd can't be created
 */
-void finish_program_routine(HANDLE* thread_handle)
+int timer_event_loop_open()
 {
-	close_handles(thread_handle); // close all open handles
-	if (g_no_errors == FALSE)
-	{ // if an error occurred during the program - exit with 1
-		exit(1);
+	if (event_loop_fd < 0) {
+		event_loop_fd = port_timerfd_create();
+		if (event_loop_fd < 0) {
+			printf("ERROR: timerfd_create failed\n");
+			return -1;
+		}
+		hw_timer_sim_init(&event_loop_sim);
 	}
+	return event_loop_fd;
 }
 
-// This function deactivates a timer
-void remove_timer(uint8 timer_id)
+// This function arms the timerfd to the earliest pending interrupt - called on every HW timer register write
+void timer_event_loop_arm()
 {
-	// input Timer ID exceeds limit
-	if (timer_id >= TMR_NUM) {
-		printf("ERROR: Timer ID exceeds limit, maximal is: %d\n", TMR_NUM - 1);
-		return NULL;
+	if (event_loop_dispatching || event_loop_fd < 0)
+		return;
+
+	hw_timer_sim_clock(&event_loop_sim);
+	event_loop_irq_lines |= hw_timer_sim_step(&event_loop_sim);
+	uint64 clock_deadline = 0; // Now
+	if (event_loop_irq_lines == 0) {
+		uint64 ticks_to_cmp = hw_timer_sim_ticks_to_cmp(&event_loop_sim);
+		if (ticks_to_cmp == 0xffffffffffffffffULL)
+			clock_deadline = PORT_WAIT_FOREVER;
+		else
+			clock_deadline = event_loop_sim.clock_start + timer_ticks_to_clock(event_loop_sim.elapsed_ticks + ticks_to_cmp, event_loop_sim.clock_freq);
 	}
-	
-	// Timer is already inactive
-	if (timer_data[timer_id].wait_us == 0)
-		printf("Timer is already inactive\n");
-	
-	// Deactivate timer
-	else {
-		timer_data[timer_id].wait_us = 0;
-		timer_data[timer_id].remain = 0;
-		timer_data[timer_id].times_fired = 0;
+	if (!port_timerfd_arm(event_loop_fd, clock_deadline)) {
+		printf("ERROR: timerfd_settime failed\n");
+		g_no_errors = FALSE;
 	}
 }
 
-// This function displays active timers
-void display_timers()
+// This function runs the ISRs of every due interrupt inline - call it when the fd of timer_event_loop_open is readable
+void timer_event_loop_dispatch()
+{
+	port_timerfd_ack(event_loop_fd);
+	event_loop_dispatching = TRUE;
+	while (TRUE) {
+		hw_timer_sim_clock(&event_loop_sim);
+		uint32 irq_lines = event_loop_irq_lines | hw_timer_sim_step(&event_loop_sim);
+		event_loop_irq_lines = 0;
+		if (irq_lines == 0)
+			break;
+		timer_irq_dispatch(irq_lines);
+	}
+	event_loop_dispatching = FALSE;
+	timer_event_loop_arm();
+}
+#else
+// Entry point of the ISR dispatcher thread - runs the ISR of every channel whose interrupt the hw timer thread raised
+void isr_thread()
 {
-	BOOL all_timers_inactive = TRUE;
-	for (int i = 0; i < TMR_NUM; i++) {
-		if (timer_data[i].wait_us != 0) {
-			printf("Timer %u - Interval: %u us, Remain: %u us, Times fired: %u\n", i, timer_data[i].wait_us, timer_data[i].remain, timer_data[i].times_fired);
-			all_timers_inactive = FALSE;
+	while (g_no_errors) {
+		if (!port_event_wait(&irq_event, PORT_WAIT_FOREVER))
+		{ // waiting for the interrupt failed
+			printf("ERROR: port_event_wait - isr thread\n");
+			g_no_errors = FALSE;
+			return;
 		}
+
+		timer_irq_dispatch(port_atomic_exchange32(&hw_irq_lines, 0));
 	}
+}
 
-	if (all_timers_inactive)
-		printf("All timers are inactive\n");
+// Entry point of the HW timer simulating thread
+void hw_timer_thread()
+{
+	hw_timer_sim_t sim;
+	hw_timer_sim_init(&sim);
+	while (TRUE) {
+		hw_timer_sim_clock(&sim);
+		uint32 irq_lines = hw_timer_sim_step(&sim);
+		if (irq_lines != 0) {
+			port_atomic_or32(&hw_irq_lines, irq_lines);
+			if (!port_event_signal(&irq_event))
+			{ // raising the interrupt failed
+				printf("ERROR: port_event_signal - hw timer thread\n");
+				g_no_errors = FALSE;
+			}
+		}
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_TICKLESS
+		// Sleep until the earliest compare value is due, or until a register write may have changed what to wait for
+		uint64 ticks_to_cmp = hw_timer_sim_ticks_to_cmp(&sim);
+		if (!port_event_wait(&hw_wake_event, ticks_to_cmp == 0xffffffffffffffffULL ? PORT_WAIT_FOREVER : ticks_to_cmp * 1000000000 / TMR_FREQ_HZ))
+		{ // sleeping failed
+			printf("ERROR: port_event_wait - hw timer thread\n");
+			g_no_errors = FALSE;
+			return;
+		}
+#else
+		port_yield(); // Give up the rest of the time slice - the QPC clock catches up on the elapsed time, the step clock ticks once
+#endif
+	}
+}
+#endif
+#endif
+
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+int menu_epoll_fd = -1; // The menu's epoll set - stdin and the timer fd
+
+/* This function runs the event loop until stdin is readable, dispatching the timer fd meanwhile
+* Returns FALSE if waiting failed
+*/
+BOOL wait_input()
+{
+	while (g_no_errors) {
+		struct epoll_event events[2];
+		int events_num = epoll_wait(menu_epoll_fd, events, 2, -1);
+		if (events_num < 0 && errno != EINTR) {
+			printf("ERROR: epoll_wait - event loop\n");
+			return FALSE;
+		}
+
+		BOOL input_ready = FALSE;
+		for (int i = 0; i < events_num; i++) {
+			if (events[i].data.fd == event_loop_fd) {
+				timer_event_loop_dispatch();
+				timer_bh_run_all(); // The bottom half runs on the loop too, after the interrupts
+			}
+			else
+				input_ready = TRUE;
+		}
+		if (input_ready)
+			return TRUE;
+	}
+	return FALSE;
+}
+#endif
+
+// This function reads a line of user input, Returns FALSE at the end of the input
+BOOL read_input_line(char* buffer, size_t size)
+{
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+	if (!wait_input())
+		return FALSE;
+#endif
+	return port_read_line(buffer, size);
 }
 
 // This function prints the main menu to the user
@@ -229,42 +3022,80 @@ void show_main_menu()
 		int decision = 0;
 		char decision_str[MAX_INPUT_LENGTH] = { 0 };
 		do { //print the main menu
+#if !TMR_PORT_HOSTED
+			timer_bh_run_all(); // The menu is the main loop on bare metal, the bottom half runs between commands
+#endif
 			printf("Choose what to do:\n"
 				"1. Display timers\n"
 				"2. Set a new timer\n"
 				"3. Remove a timer\n"
-				"4. Quit\n");
-			// get input from user
-			gets_s(decision_str, MAX_INPUT_LENGTH);
-			if (STRINGS_ARE_EQUAL(decision_str, "1")) {
+				"4. Set a one-shot timer\n"
+				"5. Quit\n"
+				"6. Display statistics\n");
+			// get input from user, the end of the input quits
+			if (!read_input_line(decision_str, MAX_INPUT_LENGTH)) {
+				user_quits = TRUE;
+			}
+			else if (STRINGS_ARE_EQUAL(decision_str, "1")) {
 				// user chose to display timers
 				display_timers();
 				decision = atoi(decision_str); // convert the string to integer
 			}
 			else if (STRINGS_ARE_EQUAL(decision_str, "2")) {
 				// client chose to set a new timer
-				printf("Insert timer ID and desired interval (ex: 1, 5):\n");
-				uint8 timer_id;
-				uint32 wait_us;
-				scanf_s("%" SCNu8 ", %u", &timer_id, &wait_us); // wait_us can be given negative - it's not a bug, it's a feature!
-				getc(stdin);
-				set_timer(timer_id, wait_us);
+				printf("Insert timer ID, desired interval and optional slack (ex: 1, 5 or 1, 5, 2):\n");
+				char timer_str[MAX_INPUT_LENGTH] = { 0 };
+				timer_id_t timer_id = 0;
+				uint32 wait_us = 0;
+				uint32 slack_us = 0;
+				read_input_line(timer_str, MAX_INPUT_LENGTH);
+				port_sscanf(timer_str, "%u, %u, %u", &timer_id, &wait_us, &slack_us); // wait_us can be given negative - it's not a bug, it's a feature!
+				set_timer_slack(timer_id, wait_us, slack_us, NULL, NULL);
 				decision = atoi(decision_str); // convert the string to integer
 			}
 			else if (STRINGS_ARE_EQUAL(decision_str, "3")) {
 				// client chose to remove a timer
 				printf("Insert timer ID to remove:\n");
-				uint8 timer_id;
-				scanf_s("%" SCNu8, &timer_id);
-				getc(stdin);
+				char timer_str[MAX_INPUT_LENGTH] = { 0 };
+				timer_id_t timer_id = 0;
+				read_input_line(timer_str, MAX_INPUT_LENGTH);
+				port_sscanf(timer_str, "%u", &timer_id);
 				remove_timer(timer_id);
 				decision = atoi(decision_str); // convert the string to integer
 			}
 			else if (STRINGS_ARE_EQUAL(decision_str, "4")) {
+				// client chose to set a one-shot timer
+				printf("Insert timer ID and desired timeout (ex: 1, 5):\n");
+				char timer_str[MAX_INPUT_LENGTH] = { 0 };
+				timer_id_t timer_id = 0;
+				uint32 wait_us = 0;
+				read_input_line(timer_str, MAX_INPUT_LENGTH);
+				port_sscanf(timer_str, "%u, %u", &timer_id, &wait_us);
+				set_timer_once(timer_id, wait_us, NULL, NULL);
+				decision = atoi(decision_str); // convert the string to integer
+			}
+			else if (STRINGS_ARE_EQUAL(decision_str, "5")) {
 				// client chose to quit
+#if TMR_TRACE
+				printf("Insert a file name to save the timer trace to, or press Enter to skip:\n");
+				char path_str[MAX_INPUT_LENGTH] = { 0 };
+				read_input_line(path_str, MAX_INPUT_LENGTH);
+				if (path_str[0] != '\0')
+					trace_save(path_str);
+#endif
 				user_quits = TRUE;
 				decision = atoi(decision_str); // convert the string to integer
 			}
+			else if (STRINGS_ARE_EQUAL(decision_str, "6")) {
+				// user chose to display statistics
+				display_timer_stats();
+				printf("Insert a file name to dump the statistics to as CSV, or press Enter to skip:\n");
+				char path_str[MAX_INPUT_LENGTH] = { 0 };
+				read_input_line(path_str, MAX_INPUT_LENGTH);
+				if (path_str[0] != '\0')
+					dump_timer_stats(path_str);
+				decision = atoi(decision_str); // convert the string to integer
+			}
 			else {
 				// user inserted invalid input
 				printf("Error: Illegal command\n");
@@ -274,41 +3105,327 @@ void show_main_menu()
 
 	// error occured, probably in hw timer thread
 	if(!g_no_errors)
-		finish_program_routine(h_hw_timer); // finish program routine
+		finish_program_routine(); // finish program routine
 }
 
-// Entry point of the HW timer simulating thread
-void hw_timer_thread()
+/* Script mode - the menu's commands read as one stream from a file or pipe, for driving the engine from scripts
+* and load tests. The input is read in TMR_SCRIPT_CHUNK_SIZE chunks, one command per line:
+* set <timer ID> <interval> [<slack>] - consecutive set lines are applied by one set_timers_batch call
+* once <timer ID> <timeout>
+* remove <timer ID>
+* wait <us> - lets the timer value pass us ticks, the timers fire meanwhile
+* display
+* summary - the aggregate of the timers in one line, see timer_snapshot_aggregate
+* stats [<CSV file>]
+* Empty lines and lines starting with # are skipped. A bad line is reported and skipped, the script goes on.
+*/
+typedef struct {
+	uint64 line; // Number of the line being run
+	uint64 commands; // Commands run, set lines included
+	uint64 rejected; // Lines that were malformed or whose command failed
+	uint64 batches; // set_timers_batch calls
+	uint32 batch_num; // set lines waiting in batch
+	timer_req_t batch[TMR_SCRIPT_BATCH];
+} script_state_t;
+
+script_state_t script_state;
+
+// This function lets the timer interrupts and the bottom half run while the script waits for them
+void script_yield()
 {
-	DWORD isr_tid; // isr thread ID
-	while (TRUE) {
-		tmr_val_reg++;
-		//printf("hw timer increased by 1, tmr_val_reg = %d\n", tmr_val_reg);
-		if (tmr_val_reg == tmr_cmp_reg)
-		{
-			h_isr = create_thread_simple((LPTHREAD_START_ROUTINE)timer_interrupt, &isr_tid);
-			if (h_isr == NULL)
-			{ // ISR thread creation failed
-				printf("ERROR: create_thread_simple - hw timer thread\n");
-				g_no_errors = FALSE;
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+	timer_event_loop_dispatch(); // No ISR thread - the interrupts that are due run here
+#endif
+#if !TMR_BH_THREADS
+	timer_bh_run_all();
+#endif
+	port_yield();
+}
+
+/* This function waits until the command ring of the calling thread's shard has at most pending commands, so the
+* commands before them are applied
+*/
+void script_wait_cmds(uint32 pending)
+{
+	timer_shard_t* p_shard = &timer_shards[timer_thread_shard];
+	while (p_shard->cmd_head - p_shard->cmd_tail > pending && g_no_errors)
+		script_yield();
+}
+
+// This function applies the set lines waiting in the batch
+void script_flush_batch()
+{
+	if (script_state.batch_num == 0)
+		return;
+	script_wait_cmds(TMR_CMD_QUEUE_SIZE - script_state.batch_num); // set_timers_batch would wait for the room anyway
+	if (!set_timers_batch(script_state.batch, script_state.batch_num))
+		script_state.rejected += script_state.batch_num;
+	script_state.batches++;
+	script_state.batch_num = 0;
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+	timer_event_loop_dispatch(); // Apply the batch before the ring is needed again
+#endif
+}
+
+/* This function parses the unsigned number at *pp_text after spaces, and moves *pp_text past it
+* Returns FALSE if there is no number there or it exceeds 32 bits
+*/
+BOOL script_parse_u32(const char** pp_text, uint32* p_value)
+{
+	const char* p_text = *pp_text;
+	while (*p_text == ' ' || *p_text == '\t' || *p_text == ',')
+		p_text++;
+	if (*p_text < '0' || *p_text > '9')
+		return FALSE;
+	uint64 value = 0;
+	while (*p_text >= '0' && *p_text <= '9') {
+		value = value * 10 + (uint64)(*p_text++ - '0');
+		if (value > 0xffffffff)
+			return FALSE;
+	}
+	*p_value = (uint32)value;
+	*pp_text = p_text;
+	return TRUE;
+}
+
+// Returns TRUE if the text at p_text is only spaces
+BOOL script_line_end(const char* p_text)
+{
+	while (*p_text == ' ' || *p_text == '\t')
+		p_text++;
+	return *p_text == '\0';
+}
+
+// Returns TRUE if the first word of the line, word_length characters long, is command
+#define SCRIPT_WORD_IS(p_line, word_length, command) ((word_length) == sizeof(command) - 1 && strncmp((p_line), (command), (word_length)) == 0)
+
+// This function runs one line of a script, which ends with a null character
+void script_run_line(const char* p_line)
+{
+	while (*p_line == ' ' || *p_line == '\t')
+		p_line++;
+	if (*p_line == '\0' || *p_line == '#')
+		return;
+	script_state.commands++;
+
+	size_t word_length = strcspn(p_line, " \t");
+	const char* p_args = p_line + word_length;
+	BOOL known = TRUE; // A well-formed command, which reports why it failed itself
+	BOOL done = FALSE;
+	if (SCRIPT_WORD_IS(p_line, word_length, "stats")) {
+		// The statistics follow the commands before them, the rest of the line is the CSV file name if any
+		script_flush_batch();
+		script_wait_cmds(0);
+		while (*p_args == ' ' || *p_args == '\t')
+			p_args++;
+		if (*p_args == '\0') {
+			display_timer_stats();
+			done = TRUE;
+		}
+		else
+			done = dump_timer_stats(p_args);
+	}
+	else if (SCRIPT_WORD_IS(p_line, word_length, "trace")) {
+		// trace start / trace save <file> - the trace holds the commands of the lines before them
+		script_flush_batch();
+		script_wait_cmds(0);
+		while (*p_args == ' ' || *p_args == '\t')
+			p_args++;
+		size_t action_length = strcspn(p_args, " \t");
+		const char* p_path = p_args + action_length;
+		while (*p_path == ' ' || *p_path == '\t')
+			p_path++;
+		if (SCRIPT_WORD_IS(p_args, action_length, "start") && *p_path == '\0')
+			done = trace_start();
+		else if (SCRIPT_WORD_IS(p_args, action_length, "save") && *p_path != '\0')
+			done = trace_save(p_path);
+		else
+			known = FALSE;
+	}
+	else {
+		uint32 args[3] = { 0 };
+		uint32 args_num = 0;
+		while (args_num < 3 && script_parse_u32(&p_args, &args[args_num]))
+			args_num++;
+		BOOL args_end = script_line_end(p_args);
+
+		if (SCRIPT_WORD_IS(p_line, word_length, "set") && (args_num == 2 || args_num == 3) && args_end) {
+			if (timer_args_valid(args[0], args[1], args[2]) && timer_shard_owned(args[0])) {
+				timer_req_t req = { args[0], args[1], args[2], NULL, NULL };
+				script_state.batch[script_state.batch_num++] = req;
+				if (script_state.batch_num == TMR_SCRIPT_BATCH)
+					script_flush_batch();
+				return;
+			}
+		}
+		else if (args_end) {
+			// Any other command runs after the set lines before it
+			script_flush_batch();
+			if (SCRIPT_WORD_IS(p_line, word_length, "once") && args_num == 2) {
+				script_wait_cmds(TMR_CMD_QUEUE_SIZE - 1);
+				done = set_timer_once(args[0], args[1], NULL, NULL);
+			}
+			else if (SCRIPT_WORD_IS(p_line, word_length, "remove") && args_num == 1) {
+				script_wait_cmds(TMR_CMD_QUEUE_SIZE - 1);
+				done = remove_timer(args[0]);
 			}
+			else if (SCRIPT_WORD_IS(p_line, word_length, "wait") && args_num == 1) {
+				uint32 start = tmr_val_reg;
+				while ((uint32)(tmr_val_reg - start) < args[0] && g_no_errors)
+					script_yield();
+				done = TRUE;
+			}
+			else if (SCRIPT_WORD_IS(p_line, word_length, "display") && args_num == 0) {
+				script_wait_cmds(0);
+				display_timers();
+				done = TRUE;
+			}
+			else if (SCRIPT_WORD_IS(p_line, word_length, "summary") && args_num == 0) {
+				script_wait_cmds(0);
+				done = display_timer_summary();
+			}
+			else
+				known = FALSE;
+		}
+		else
+			known = FALSE;
+	}
+
+	if (!done) {
+		printf("ERROR: Script line %llu: %s: %s\n", script_state.line, known ? "Failed" : "Illegal command", p_line);
+		script_state.rejected++;
+	}
+}
+
+/* This function runs the script in the file at path, standard input for "-", and prints how many commands it ran
+* Returns FALSE if the file can't be read or a line doesn't fit the input chunk
+*/
+BOOL run_script(const char* path)
+{
+	FILE* p_file = STRINGS_ARE_EQUAL(path, "-") ? stdin : port_fopen(path, "rb");
+	if (p_file == NULL) {
+		printf("ERROR: Can't open %s for reading\n", path);
+		return FALSE;
+	}
+
+	static char chunk[TMR_SCRIPT_CHUNK_SIZE + 1];
+	size_t chunk_size = 0; // Bytes of chunk[] not run yet, the beginning of a line
+	BOOL input_end = FALSE;
+	BOOL line_too_long = FALSE;
+	uint64 clock_start = port_clock();
+	while (!input_end && !line_too_long && g_no_errors) {
+		size_t read_size = fread(chunk + chunk_size, 1, TMR_SCRIPT_CHUNK_SIZE - chunk_size, p_file);
+		chunk_size += read_size;
+		input_end = read_size == 0;
+		if (input_end && chunk_size != 0)
+			chunk[chunk_size++] = '\n'; // The last line may have no newline
+
+		// Run every whole line of the chunk, the part line after them moves to the front
+		char* p_line = chunk;
+		char* p_chunk_end = chunk + chunk_size;
+		char* p_newline;
+		while ((p_newline = (char*)memchr(p_line, '\n', (size_t)(p_chunk_end - p_line))) != NULL) {
+			*p_newline = '\0';
+			if (p_newline > p_line && p_newline[-1] == '\r')
+				p_newline[-1] = '\0';
+			script_state.line++;
+			script_run_line(p_line);
+			p_line = p_newline + 1;
+		}
+		chunk_size = (size_t)(p_chunk_end - p_line);
+		memmove(chunk, p_line, chunk_size);
+		if (chunk_size == TMR_SCRIPT_CHUNK_SIZE) {
+			printf("ERROR: Script line %llu is longer than %u characters\n", script_state.line + 1, TMR_SCRIPT_CHUNK_SIZE);
+			line_too_long = TRUE;
 		}
-		Sleep(0.001); // delay of 0.001ms=1us -> freq=1MHz
 	}
+	script_flush_batch();
+	script_wait_cmds(0);
+	double seconds = (double)((port_clock() - clock_start) & TMR_PORT_CLOCK_MASK) / (double)port_clock_freq();
+	if (p_file != stdin)
+		fclose(p_file);
+
+	printf("Script: %llu lines, %llu commands (%llu set_timers_batch calls), %llu rejected, %.3f s, %.0f commands/s\n",
+		script_state.line, script_state.commands, script_state.batches, script_state.rejected, seconds,
+		seconds > 0 ? (double)script_state.commands / seconds : 0.0);
+	return !line_too_long;
 }
 
-int main() {
+#ifndef SW_TIMER_NO_MAIN
+int main(int argc, char** argv) {
+
+	// SW_Timer <script file, - for standard input> runs the script instead of the menu, with its output in blocks
+	BOOL script_mode = argc == 2;
+	if (script_mode)
+		setvbuf(stdout, NULL, _IOFBF, TMR_SCRIPT_OUTPUT_SIZE);
+	else if (argc > 2) {
+		printf("Usage: %s [<script file>|-]\n", argv[0]);
+		return 1;
+	}
+
+	queue_init();
+
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+	// No simulation threads - the menu waits for input in an epoll loop that also dispatches the timer fd
+	int timer_fd = timer_event_loop_open();
+	menu_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event timer_ev = { EPOLLIN, { .fd = timer_fd } };
+	struct epoll_event input_ev = { EPOLLIN, { .fd = STDIN_FILENO } };
+	// A script is read without waiting for input, its waits dispatch the timer fd themselves
+	if (timer_fd < 0 || menu_epoll_fd < 0 || epoll_ctl(menu_epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_ev) != 0 ||
+		(!script_mode && epoll_ctl(menu_epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &input_ev) != 0))
+	{ // event loop setup failed
+		printf("ERROR: epoll - event loop\n");
+		g_no_errors = FALSE;
+		finish_program_routine(); // finish program routine
+	}
+	if (!script_mode)
+		setvbuf(stdin, NULL, _IONBF, 0); // Input buffered by stdio would not make stdin readable
+	timer_event_loop_arm();
+#elif TMR_PORT_HOSTED
+	// The bottom-half workers sleep until the ISR queues fires for them
+	if (!timer_bh_start())
+	{ // worker thread creation failed
+		printf("ERROR: port_thread_create - bottom-half worker\n");
+		g_no_errors = FALSE;
+		finish_program_routine(); // finish program routine
+	}
+
+	// The ISR thread lives for the whole program and sleeps until the interrupt is raised
+	if (!port_event_create(&irq_event, FALSE) || !port_thread_create(&h_isr, isr_thread, TRUE))
+	{ // isr thread creation failed
+		printf("ERROR: port_thread_create - isr thread\n");
+		g_no_errors = FALSE;
+		finish_program_routine(); // finish program routine
+	}
+
+	// The tickless hw timer thread sleeps on a timed event until the compare value, register writes wake it early
+	if (!port_event_create(&hw_wake_event, TMR_SIM_CLOCK == TMR_SIM_CLOCK_TICKLESS))
+	{ // tickless simulation setup failed
+		printf("ERROR: port_event_create - hw timer thread\n");
+		g_no_errors = FALSE;
+		finish_program_routine(); // finish program routine
+	}
 
-	h_hw_timer = create_thread_simple((LPTHREAD_START_ROUTINE)hw_timer_thread, &hw_timer_tid);
-	if (h_hw_timer == NULL)
+	if (!port_thread_create(&h_hw_timer, hw_timer_thread, FALSE))
 	{ // hw timer thread creation failed
-		printf("ERROR: create_thread_simple - hw timer thread\n");
+		printf("ERROR: port_thread_create - hw timer thread\n");
 		g_no_errors = FALSE;
-		finish_program_routine(h_hw_timer); // finish program routine
+		finish_program_routine(); // finish program routine
 	}
+#else
+	// Channel 0 interrupts for the timer queue, the board's vectors call timer_irq_dispatch
+	tmr_channels[0].en_reg = 1;
+#endif
 
+	if (script_mode) {
+		BOOL script_ran = run_script(argv[1]);
+		fflush(stdout);
+		return script_ran && g_no_errors ? 0 : 1;
+	}
 	show_main_menu();
 
 	return 0;
 
 }
+#endif
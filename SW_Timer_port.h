@@ -0,0 +1,55 @@
+/*
+SW Timer platform port.
+The timer core only talks to the platform through this layer - threads, a high resolution clock, wait/notify events,
+atomics and console/file input, so the same engine source builds for:
+TMR_PORT_WIN32 - Win32 threads and events, the HW timer and its interrupts are simulated by threads
+TMR_PORT_POSIX - pthreads and condition variables on CLOCK_MONOTONIC (Linux, BSD, macOS), simulated like Win32
+TMR_PORT_BAREMETAL - a real memory-mapped HW timer at TMR_REGS_BASE with real interrupts, no threads
+Every port header provides:
+TMR_PORT_HOSTED - 1 where an OS runs the simulated HW timer and ISR threads, 0 on bare metal
+TMR_PORT_CLOCK_MASK - the bits of port_clock that count, durations are taken modulo it
+BOOL, TRUE, FALSE
+port_clock(), port_clock_freq() - a monotonic high resolution counter and its frequency in Hz
+port_memory_barrier() - a full hardware memory barrier
+port_release_barrier() - orders the accesses before it before the stores after it
+port_acquire_barrier() - orders the loads before it before the accesses after it, both compiler barriers only where
+the hardware keeps that order anyway
+port_atomic_or32, port_atomic_exchange32 - atomic read-modify-write, returning the old value
+port_thread_pin(core) - best effort pinning of the calling thread to a CPU core
+port_yield() - give up the rest of the time slice
+port_read_line, port_sscanf, port_fopen - console and file input
+and, where TMR_PORT_HOSTED is 1:
+port_thread_t, port_thread_create, port_thread_close - detached threads running a void (void) routine
+port_event_t, port_event_create, port_event_signal, port_event_wait, port_event_close - auto-reset events,
+port_event_wait returns after a signal or after timeout_ns (PORT_WAIT_FOREVER for none)
+and, where TMR_PORT_HAS_TIMERFD is 1:
+port_timerfd_create, port_timerfd_arm, port_timerfd_ack - a pollable fd that becomes readable at a port clock deadline
+*/
+
+#ifndef SW_TIMER_PORT_H
+#define SW_TIMER_PORT_H
+
+#define TMR_PORT_WIN32 0
+#define TMR_PORT_POSIX 1
+#define TMR_PORT_BAREMETAL 2
+#ifndef TMR_PORT
+#if defined(_WIN32)
+#define TMR_PORT TMR_PORT_WIN32
+#else
+#define TMR_PORT TMR_PORT_POSIX
+#endif
+#endif
+
+#define PORT_WAIT_FOREVER 0xffffffffffffffffULL // port_event_wait timeout - wait for a signal only
+
+#if TMR_PORT == TMR_PORT_WIN32
+#include "SW_Timer_port_win32.h"
+#elif TMR_PORT == TMR_PORT_POSIX
+#include "SW_Timer_port_posix.h"
+#elif TMR_PORT == TMR_PORT_BAREMETAL
+#include "SW_Timer_port_baremetal.h"
+#else
+#error "TMR_PORT must be TMR_PORT_WIN32, TMR_PORT_POSIX or TMR_PORT_BAREMETAL"
+#endif
+
+#endif
@@ -0,0 +1,72 @@
+/*
+SW Timer bare-metal port, see SW_Timer_port.h.
+The HW timer registers are memory-mapped at TMR_REGS_BASE, and the board's interrupt vectors call timer_irq_dispatch.
+The engine runs on a single core: main is the set_timer thread and the ISRs preempt it, so there are no threads or
+events, and yielding is not needed - a raised interrupt is taken before the next instruction of the caller.
+Console input and file output go through the C library's retargeted stdio (newlib and the like).
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef TMR_REGS_BASE
+#error "TMR_REGS_BASE - the address of the HW timer registers - must be defined for bare-metal builds"
+#endif
+
+#define TMR_PORT_HOSTED 0
+#define TMR_PORT_CLOCK_MASK 0xffffffffULL // port_clock is the 32-bit HW timer counter
+
+typedef int BOOL;
+#define TRUE 1
+#define FALSE 0
+
+// The HW timer counter is the only clock every target has, its value register comes first
+static inline uint64_t port_clock(void)
+{
+	return *(volatile uint32_t*)(TMR_REGS_BASE);
+}
+
+#define port_clock_freq() TMR_FREQ_HZ
+
+#define port_memory_barrier() __sync_synchronize()
+#define port_release_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define port_acquire_barrier() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+// Read-modify-write of data shared with the ISRs
+static inline uint32_t port_atomic_or32(volatile uint32_t* p_value, uint32_t bits)
+{
+	return __atomic_fetch_or(p_value, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t port_atomic_exchange32(volatile uint32_t* p_value, uint32_t value)
+{
+	return __atomic_exchange_n(p_value, value, __ATOMIC_SEQ_CST);
+}
+
+static inline void port_thread_pin(uint32_t core)
+{
+	(void)core;
+}
+
+static inline void port_yield(void)
+{
+}
+
+// This function reads a line from stdin without its newline. Returns FALSE at the end of the input
+static inline BOOL port_read_line(char* buffer, size_t size)
+{
+	if (fgets(buffer, (int)size, stdin) == NULL) {
+		buffer[0] = '\0';
+		return FALSE;
+	}
+	buffer[strcspn(buffer, "\r\n")] = '\0';
+	return TRUE;
+}
+
+#define port_sscanf sscanf
+
+static inline FILE* port_fopen(const char* path, const char* mode)
+{
+	return fopen(path, mode);
+}
@@ -0,0 +1,223 @@
+/*
+SW Timer POSIX port, see SW_Timer_port.h.
+Events are a condition variable on CLOCK_MONOTONIC, so timed waits sleep until an absolute deadline
+like clock_nanosleep, and can be woken early.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np - must come before the first system header
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+#define TMR_PORT_HOSTED 1
+#define TMR_PORT_CLOCK_MASK 0xffffffffffffffffULL
+
+typedef int BOOL;
+#define TRUE 1
+#define FALSE 0
+
+typedef pthread_t port_thread_t;
+
+// An auto-reset event
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond; // Waits on CLOCK_MONOTONIC
+	BOOL signaled;
+	BOOL created;
+} port_event_t;
+
+static inline uint64_t port_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static inline uint64_t port_clock_freq(void)
+{
+	return 1000000000; // port_clock counts nanoseconds
+}
+
+#define port_memory_barrier() __sync_synchronize()
+#define port_release_barrier() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define port_acquire_barrier() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+static inline uint32_t port_atomic_or32(volatile uint32_t* p_value, uint32_t bits)
+{
+	return __atomic_fetch_or(p_value, bits, __ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t port_atomic_exchange32(volatile uint32_t* p_value, uint32_t value)
+{
+	return __atomic_exchange_n(p_value, value, __ATOMIC_SEQ_CST);
+}
+
+static inline void port_thread_pin(uint32_t core)
+{
+#if defined(__linux__)
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(core, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+	(void)core; // No portable affinity API
+#endif
+}
+
+static inline void port_yield(void)
+{
+	sched_yield();
+}
+
+// Runs the void (void) routine of a thread created by port_thread_create
+static inline void* port_thread_start(void* p_routine)
+{
+	((void (*)(void))p_routine)();
+	return NULL;
+}
+
+/* This function creates a detached thread running p_routine, time critical threads bound the fire latency under load
+* (real-time priority needs CAP_SYS_NICE, without it the thread runs at normal priority).
+* Returns FALSE if the thread can't be created
+*/
+static inline BOOL port_thread_create(port_thread_t* p_thread, void (*p_routine)(void), BOOL time_critical)
+{
+	if (pthread_create(p_thread, NULL, port_thread_start, (void*)p_routine) != 0)
+		return FALSE;
+	pthread_detach(*p_thread);
+	if (time_critical) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		pthread_setschedparam(*p_thread, SCHED_FIFO, &param);
+	}
+	return TRUE;
+}
+
+// Detached threads need no closing
+static inline BOOL port_thread_close(port_thread_t* p_thread)
+{
+	(void)p_thread;
+	return TRUE;
+}
+
+// This function creates an auto-reset event, any event can be waited on with a timeout. Returns FALSE if creation failed
+static inline BOOL port_event_create(port_event_t* p_event, BOOL timed)
+{
+	(void)timed;
+	pthread_condattr_t attr;
+	if (pthread_condattr_init(&attr) != 0)
+		return FALSE;
+	BOOL created = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 &&
+		pthread_mutex_init(&p_event->mutex, NULL) == 0 &&
+		pthread_cond_init(&p_event->cond, &attr) == 0;
+	pthread_condattr_destroy(&attr);
+	p_event->signaled = FALSE;
+	p_event->created = created;
+	return created;
+}
+
+static inline BOOL port_event_signal(port_event_t* p_event)
+{
+	if (pthread_mutex_lock(&p_event->mutex) != 0)
+		return FALSE;
+	p_event->signaled = TRUE;
+	pthread_cond_signal(&p_event->cond);
+	pthread_mutex_unlock(&p_event->mutex);
+	return TRUE;
+}
+
+// This function waits until the event is signaled or timeout_ns passed. Returns FALSE if waiting failed
+static inline BOOL port_event_wait(port_event_t* p_event, uint64_t timeout_ns)
+{
+	struct timespec deadline;
+	if (timeout_ns != PORT_WAIT_FOREVER) {
+		uint64_t deadline_ns = port_clock() + timeout_ns;
+		deadline.tv_sec = (time_t)(deadline_ns / 1000000000);
+		deadline.tv_nsec = (long)(deadline_ns % 1000000000);
+	}
+
+	if (pthread_mutex_lock(&p_event->mutex) != 0)
+		return FALSE;
+	int res = 0;
+	while (!p_event->signaled && res == 0) {
+		if (timeout_ns == PORT_WAIT_FOREVER)
+			res = pthread_cond_wait(&p_event->cond, &p_event->mutex);
+		else
+			res = pthread_cond_timedwait(&p_event->cond, &p_event->mutex, &deadline);
+	}
+	p_event->signaled = FALSE;
+	pthread_mutex_unlock(&p_event->mutex);
+	return res == 0 || res == ETIMEDOUT;
+}
+
+static inline BOOL port_event_close(port_event_t* p_event)
+{
+	if (!p_event->created)
+		return TRUE;
+	p_event->created = FALSE;
+	return pthread_cond_destroy(&p_event->cond) == 0 && pthread_mutex_destroy(&p_event->mutex) == 0;
+}
+
+// This function reads a line from stdin without its newline. Returns FALSE at the end of the input
+static inline BOOL port_read_line(char* buffer, size_t size)
+{
+	if (fgets(buffer, (int)size, stdin) == NULL) {
+		buffer[0] = '\0';
+		return FALSE;
+	}
+	buffer[strcspn(buffer, "\r\n")] = '\0';
+	return TRUE;
+}
+
+#define port_sscanf sscanf
+
+static inline FILE* port_fopen(const char* path, const char* mode)
+{
+	return fopen(path, mode);
+}
+
+#if defined(__linux__)
+#define TMR_PORT_HAS_TIMERFD 1
+
+// This function creates a non-blocking timerfd on CLOCK_MONOTONIC, the port clock. Returns -1 if creation failed
+static inline int port_timerfd_create(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+/* This function arms the timerfd to become readable at the port clock time clock_deadline - at once for 0,
+* never for PORT_WAIT_FOREVER. Returns FALSE if arming failed
+*/
+static inline BOOL port_timerfd_arm(int fd, uint64_t clock_deadline)
+{
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if (clock_deadline != PORT_WAIT_FOREVER) {
+		if (clock_deadline == 0)
+			clock_deadline = 1; // Long passed - a zero it_value would disarm the timerfd
+		spec.it_value.tv_sec = (time_t)(clock_deadline / 1000000000);
+		spec.it_value.tv_nsec = (long)(clock_deadline % 1000000000);
+	}
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL) == 0;
+}
+
+// This function makes a readable timerfd unreadable until it expires again
+static inline void port_timerfd_ack(int fd)
+{
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) < 0)
+		expirations = 0; // Not expired - EAGAIN
+}
+#endif
@@ -0,0 +1,153 @@
+/*
+SW Timer Win32 port, see SW_Timer_port.h.
+The tickless HW timer simulation sleeps on a high resolution waitable timer next to the event.
+*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#define TMR_PORT_HOSTED 1
+#define TMR_PORT_CLOCK_MASK 0xffffffffffffffffULL
+
+typedef HANDLE port_thread_t;
+
+// An auto-reset event, and the waitable timer that bounds waits on it (NULL for untimed events)
+typedef struct {
+	HANDLE event;
+	HANDLE timer;
+} port_event_t;
+
+static __inline uint64_t port_clock(void)
+{
+	LARGE_INTEGER qpc;
+	QueryPerformanceCounter(&qpc);
+	return (uint64_t)qpc.QuadPart;
+}
+
+static __inline uint64_t port_clock_freq(void)
+{
+	LARGE_INTEGER qpc_freq;
+	QueryPerformanceFrequency(&qpc_freq);
+	return (uint64_t)qpc_freq.QuadPart;
+}
+
+#define port_memory_barrier() MemoryBarrier()
+#if defined(_M_IX86) || defined(_M_X64)
+// x86 keeps loads in order with loads and stores with stores, only the compiler must not reorder them
+#define port_release_barrier() _ReadWriteBarrier()
+#define port_acquire_barrier() _ReadWriteBarrier()
+#else
+#define port_release_barrier() MemoryBarrier()
+#define port_acquire_barrier() MemoryBarrier()
+#endif
+
+static __inline uint32_t port_atomic_or32(volatile uint32_t* p_value, uint32_t bits)
+{
+	return (uint32_t)InterlockedOr((volatile LONG*)p_value, (LONG)bits);
+}
+
+static __inline uint32_t port_atomic_exchange32(volatile uint32_t* p_value, uint32_t value)
+{
+	return (uint32_t)InterlockedExchange((volatile LONG*)p_value, (LONG)value);
+}
+
+static __inline void port_thread_pin(uint32_t core)
+{
+	SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core);
+}
+
+static __inline void port_yield(void)
+{
+	Sleep(0);
+}
+
+/* This function creates a thread running p_routine, time critical threads bound the fire latency under load
+* Returns FALSE if the thread can't be created
+*/
+static __inline BOOL port_thread_create(port_thread_t* p_thread, void (*p_routine)(void), BOOL time_critical)
+{
+	DWORD thread_id;
+	*p_thread = CreateThread(
+		NULL,            /*  default security attributes */
+		0,               /*  use default stack size */
+		(LPTHREAD_START_ROUTINE)p_routine, /*  thread function */
+		NULL,/*  argument to thread function */
+		0,               /*  use default creation flags */
+		&thread_id);     /*  returns the thread identifier */
+	if (*p_thread == NULL)
+		return FALSE;
+	if (time_critical)
+		SetThreadPriority(*p_thread, THREAD_PRIORITY_TIME_CRITICAL);
+	return TRUE;
+}
+
+// This function closes a thread handle, the thread keeps running. Returns FALSE if closing failed
+static __inline BOOL port_thread_close(port_thread_t* p_thread)
+{
+	if (*p_thread == NULL)
+		return TRUE;
+	if (FALSE == CloseHandle(*p_thread))
+		return FALSE;
+	*p_thread = NULL;
+	return TRUE;
+}
+
+// This function creates an auto-reset event, timed events can be waited on with a timeout. Returns FALSE if creation failed
+static __inline BOOL port_event_create(port_event_t* p_event, BOOL timed)
+{
+	p_event->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	p_event->timer = timed ? CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS) : NULL;
+	return p_event->event != NULL && (!timed || p_event->timer != NULL);
+}
+
+static __inline BOOL port_event_signal(port_event_t* p_event)
+{
+	return SetEvent(p_event->event);
+}
+
+// This function waits until the event is signaled or timeout_ns passed. Returns FALSE if waiting failed
+static __inline BOOL port_event_wait(port_event_t* p_event, uint64_t timeout_ns)
+{
+	HANDLE wait_handles[2] = { p_event->event, p_event->timer };
+	DWORD handles_num = 1;
+	if (timeout_ns != PORT_WAIT_FOREVER) {
+		// Relative due time in 100ns units, negative means relative
+		LARGE_INTEGER due_time;
+		due_time.QuadPart = -(LONGLONG)(timeout_ns / 100);
+		if (p_event->timer == NULL || FALSE == SetWaitableTimer(p_event->timer, &due_time, 0, NULL, NULL, FALSE))
+			return FALSE;
+		handles_num = 2;
+	}
+
+	DWORD wait_res = WaitForMultipleObjects(handles_num, wait_handles, FALSE, INFINITE);
+	return wait_res == WAIT_OBJECT_0 || wait_res == WAIT_OBJECT_0 + 1;
+}
+
+static __inline BOOL port_event_close(port_event_t* p_event)
+{
+	BOOL closed = TRUE;
+	if (p_event->event != NULL && FALSE == CloseHandle(p_event->event))
+		closed = FALSE;
+	if (p_event->timer != NULL && FALSE == CloseHandle(p_event->timer))
+		closed = FALSE;
+	p_event->event = NULL;
+	p_event->timer = NULL;
+	return closed;
+}
+
+// This function reads a line from stdin without its newline. Returns FALSE at the end of the input
+static __inline BOOL port_read_line(char* buffer, size_t size)
+{
+	return gets_s(buffer, size) != NULL;
+}
+
+#define port_sscanf sscanf_s
+
+static __inline FILE* port_fopen(const char* path, const char* mode)
+{
+	FILE* p_file = NULL;
+	if (fopen_s(&p_file, path, mode) != 0)
+		return NULL;
+	return p_file;
+}
@@ -0,0 +1,233 @@
+/*
+SW Timer trace replay.
+Replays a trace recorded with TMR_TRACE 1 (trace_save) through the timer engine as fast as it goes: every command
+is given by set_timer_slack/set_timer_once/set_timer_at/set_timer_long/set_timer_at64/remove_timer at its recorded
+timer value, on a simulated tmr_val_reg that jumps from one command or compare value to the next, with the benchmark
+calling timer_interrupt itself. Every fire is checked against a model of when each timer is due, and against the
+fires before it - a timer may not fire after another one that was not yet due when it already had to - and the run
+reports the fire correctness, the lateness, and the throughput against the recording's own duration.
+The trace has no records of the interrupts that only kept the timer value extension going, so records more than
+TMR_MAX_CMP_DISTANCE ticks apart are taken for out of order ones, replayed at the time of the previous record.
+The backend is chosen at build time like in the engine, each build prints rows in the same format:
+for %b in (0 1 2) do @(cl /nologo /O2 /DTMR_BACKEND=%b /FeSW_Timer_replay%b.exe SW_Timer_replay.c >nul && SW_Timer_replay%b.exe trace.bin)
+*/
+
+#define SW_TIMER_NO_MAIN
+#ifndef TMR_NUM
+#define TMR_NUM (1 << 16) // IDs of the replayed timers must be below it
+#endif
+#define TMR_STATS 0 // The engine's own statistics would be measured along
+#define TMR_SIM_CLOCK 0 // TMR_SIM_CLOCK_STEP - register writes don't wake a tickless hw timer thread
+#include "SW_Timer_executable.c"
+
+// When a replayed timer is due, as the trace says it was set, in the replay's 64-bit time
+typedef struct {
+	uint64 soft_expiry; // It may fire from here on
+	uint64 hard_expiry; // It must have fired here
+	uint64 wait_us; // 0 for a one-shot timer
+	BOOL active;
+} replay_model_t;
+
+replay_model_t replay_model[TMR_NUM];
+uint64 replay_now = 0; // The replay's 64-bit time, its low 32 bits are tmr_val_reg
+uint32 replay_recorded_fires[TMR_NUM]; // TMR_TRACE_FIRE records of each timer
+uint32 replay_fires[TMR_NUM]; // Fires of each timer in the replay
+uint64 replay_late_hist[TMR_LATE_BUCKETS]; // Lateness of the replayed fires after their hard expiry, as in timer_late_hist
+uint64 replay_late_max = 0;
+uint64 replay_early = 0; // Fires before the soft expiry
+uint64 replay_spurious = 0; // Fires of timers the model has inactive
+uint64 replay_rejected = 0; // Commands the engine refused
+uint64 replay_out_of_order = 0; // Fires after an earlier fire of a timer that was due later
+uint64 replay_order_due = 0; // The latest time a timer fired before replay_order_now was due from, up to its fire
+uint64 replay_order_pending = 0; // The same of the fires at replay_order_now, they don't order among each other
+uint64 replay_order_now = 0;
+const char* replay_backend_names[] = { "flat", "heap", "wheel" }; // Indexed by TMR_BACKEND
+
+// Callback of every replayed timer - checks the fire against the model, and moves the model to the next period
+void replay_fire(timer_id_t timer_id, void* ctx)
+{
+	replay_model_t* p_model = &replay_model[timer_id];
+	replay_fires[timer_id]++;
+	if (!p_model->active) {
+		replay_spurious++;
+		return;
+	}
+	if (replay_now < p_model->soft_expiry)
+		replay_early++;
+
+	// Deadline order - the fires of one time are one batch, a later fire must not have been due before an earlier one
+	if (replay_now != replay_order_now) {
+		if (replay_order_pending > replay_order_due)
+			replay_order_due = replay_order_pending;
+		replay_order_now = replay_now;
+	}
+	if (p_model->hard_expiry < replay_order_due)
+		replay_out_of_order++;
+	uint64 due = p_model->soft_expiry < replay_now ? p_model->soft_expiry : replay_now;
+	if (due > replay_order_pending)
+		replay_order_pending = due;
+
+	uint64 late_us = replay_now > p_model->hard_expiry ? replay_now - p_model->hard_expiry : 0;
+	replay_late_hist[late_bucket(late_us > 0xffffffff ? 0xffffffff : (uint32)late_us)]++;
+	if (late_us > replay_late_max)
+		replay_late_max = late_us;
+
+	if (p_model->wait_us == 0) {
+		p_model->active = FALSE;
+		return;
+	}
+	// Periods follow the deadlines, the ones a late fire skipped are overruns like in the engine
+	uint64 missed = late_us / p_model->wait_us;
+	p_model->soft_expiry += (missed + 1) * p_model->wait_us;
+	p_model->hard_expiry += (missed + 1) * p_model->wait_us;
+}
+
+// This function moves the replay's time to timer_value, running every timer interrupt that is due on the way
+void replay_advance(uint32 timer_value)
+{
+	uint32 distance = timer_value - (uint32)replay_now;
+	if (distance > TMR_MAX_CMP_DISTANCE)
+		distance = 0; // A command stamped before the previous record - time doesn't go back
+	uint64 target = replay_now + distance;
+	while (TRUE) {
+		uint32 cmp = tmr_channels[0].cmp_reg;
+		uint32 cmp_distance = cmp - (uint32)replay_now;
+		if (cmp_distance == 0 || cmp_distance > target - replay_now)
+			break;
+		replay_now += cmp_distance;
+		tmr_val_reg = (uint32)replay_now;
+		timer_interrupt();
+	}
+	replay_now = target;
+	tmr_val_reg = (uint32)replay_now;
+}
+
+// This function gives a command record to the engine at the current replay time, and models when the timer is due
+void replay_command(const trace_record_t* p_record)
+{
+	timer_id_t timer_id = p_record->type_id & TRACE_ID_MASK;
+	trace_type_t type = (trace_type_t)(p_record->type_id >> TRACE_TYPE_SHIFT);
+	uint64 long_wait_us = p_record->wait_us | ((uint64)p_record->slack_us << 32);
+	replay_model_t model = { replay_now + p_record->wait_us, replay_now + p_record->wait_us, 0, p_record->wait_us != 0 };
+	BOOL set = FALSE;
+	switch (type) {
+	case TMR_TRACE_SET:
+		model.hard_expiry += p_record->slack_us;
+		model.wait_us = p_record->wait_us;
+		set = set_timer_slack(timer_id, p_record->wait_us, p_record->slack_us, replay_fire, NULL);
+		break;
+	case TMR_TRACE_SET_ONCE:
+		set = set_timer_once(timer_id, p_record->wait_us, replay_fire, NULL);
+		break;
+	case TMR_TRACE_SET_AT:
+		// The command time may have been moved up to the previous record, the absolute deadline stays
+		model.soft_expiry = model.hard_expiry = replay_now + (uint32)(p_record->time + p_record->wait_us - (uint32)replay_now);
+		model.active = TRUE;
+		set = set_timer_at(timer_id, p_record->time + p_record->wait_us, replay_fire, NULL);
+		break;
+	case TMR_TRACE_SET_LONG:
+	case TMR_TRACE_SET_AT64:
+		model.soft_expiry = model.hard_expiry = replay_now + long_wait_us;
+		model.wait_us = type == TMR_TRACE_SET_LONG ? long_wait_us : 0;
+		set = type == TMR_TRACE_SET_LONG ? set_timer_long(timer_id, long_wait_us, replay_fire, NULL) :
+			set_timer_at64(timer_id, timer_now64() + long_wait_us, replay_fire, NULL);
+		break;
+	case TMR_TRACE_REMOVE:
+		model.active = FALSE;
+		set = remove_timer(timer_id); // Also when a one-shot timer fired just before
+		break;
+	default:
+		return;
+	}
+
+	if (!set) {
+		replay_rejected++;
+		return;
+	}
+	replay_model[timer_id] = model;
+	timer_interrupt(); // The software interrupt the call raised
+}
+
+// Returns the lateness below which the given fraction of the replayed fires are, as the upper end of its histogram bucket
+uint64 replay_late_percentile(uint64 fires_num, double fraction)
+{
+	uint64 fires = 0;
+	for (uint32 bucket = 0; bucket < TMR_LATE_BUCKETS; bucket++) {
+		fires += replay_late_hist[bucket];
+		if ((double)fires >= fraction * (double)fires_num)
+			return bucket == 0 ? 0 : (1ULL << bucket) - 1;
+	}
+	return replay_late_max;
+}
+
+int main(int argc, char** argv) {
+
+	if (argc != 2) {
+		printf("Usage: %s <trace file>\n", argv[0]);
+		return 1;
+	}
+	FILE* p_file = port_fopen(argv[1], "rb");
+	trace_header_t header;
+	if (p_file == NULL || fread(&header, sizeof(header), 1, p_file) != 1 || memcmp(header.magic, "SWTT", 4) != 0 || header.version != 1) {
+		printf("ERROR: %s is not a timer trace\n", argv[1]);
+		return 1;
+	}
+	if (header.freq_hz != TMR_FREQ_HZ)
+		printf("The trace was recorded at %u Hz, replaying it at %u Hz\n", header.freq_hz, TMR_FREQ_HZ);
+	trace_record_t* records = (trace_record_t*)malloc((size_t)header.records_num * sizeof(trace_record_t) + 1);
+	if (records == NULL || fread(records, sizeof(trace_record_t), header.records_num, p_file) != header.records_num) {
+		printf("ERROR: %s is truncated\n", argv[1]);
+		return 1;
+	}
+	fclose(p_file);
+
+	uint32 commands_num = 0;
+	for (uint32 i = 0; i < header.records_num; i++) {
+		if ((records[i].type_id & TRACE_ID_MASK) >= TMR_NUM) {
+			printf("ERROR: The trace has timer IDs from %u on, build with a larger TMR_NUM\n", records[i].type_id & TRACE_ID_MASK);
+			return 1;
+		}
+		if ((records[i].type_id >> TRACE_TYPE_SHIFT) != TMR_TRACE_FIRE)
+			commands_num++;
+	}
+
+	// The engine starts at the first record, its first interrupt takes the time base from there
+	queue_init();
+	if (header.records_num != 0) {
+		replay_now = records[0].time;
+		tmr_val_reg = records[0].time;
+	}
+	replay_order_now = replay_now;
+	uint64 replay_start = replay_now;
+	uint64 clock_start = port_clock();
+	for (uint32 i = 0; i < header.records_num; i++) {
+		replay_advance(records[i].time);
+		if ((records[i].type_id >> TRACE_TYPE_SHIFT) == TMR_TRACE_FIRE)
+			replay_recorded_fires[records[i].type_id & TRACE_ID_MASK]++;
+		else
+			replay_command(&records[i]);
+	}
+	double wall_ns = (double)(port_clock() - clock_start) * 1e9 / (double)port_clock_freq();
+
+	// Timers the model has due by the end of the trace should have fired
+	uint64 missed = 0;
+	uint64 fires_num = 0;
+	uint32 fires_differ = 0;
+	for (timer_id_t i = 0; i < TMR_NUM; i++) {
+		if (replay_model[i].active && replay_model[i].hard_expiry < replay_now)
+			missed++;
+		fires_num += replay_fires[i];
+		if (replay_fires[i] != replay_recorded_fires[i])
+			fires_differ++;
+	}
+
+	double trace_us = (double)(replay_now - replay_start) * 1e6 / (double)TMR_FREQ_HZ;
+	printf("%-6s %9s %9s %9s %6s %6s %6s %6s %6s %8s %8s %8s %8s %10s %10s\n", "queue", "records", "commands", "fires", "early",
+		"missed", "spur", "order", "reject", "p50 us", "p99 us", "max us", "diff", "Mrec/s", "x realtime");
+	printf("%-6s %9u %9u %9llu %6llu %6llu %6llu %6llu %6llu %8llu %8llu %8llu %8u %10.3f %10.0f\n", replay_backend_names[TMR_BACKEND], header.records_num,
+		commands_num, fires_num, replay_early, missed, replay_spurious, replay_out_of_order, replay_rejected, replay_late_percentile(fires_num, 0.5),
+		replay_late_percentile(fires_num, 0.99), replay_late_max, fires_differ, (double)header.records_num * 1e3 / wall_ns,
+		trace_us * 1e3 / wall_ns);
+	free(records);
+	return replay_early + missed + replay_spurious + replay_out_of_order != 0;
+}
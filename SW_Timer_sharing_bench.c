@@ -0,0 +1,119 @@
+/*
+SW Timer false sharing benchmark.
+Lists the engine state that different threads write on every tick, interrupt or command, with the cache line each
+variable falls on, and counts the lines more than one writer shares. The count is not measured - it is worked out
+from the variables' addresses and sharing_vars, a table of which thread writes what kept by hand, which has to be
+updated along with the engine when hot state is added or changes owner. Then it measures what sharing costs: a thread
+pinned to core 1 writes tmr_val_reg like the hw timer thread does on every tick, while the main thread, pinned to
+core 0, writes the compare register and reads g_no_errors like the ISR does, first alone and then against the ticks.
+TMR_PAD_HOT_STATE 0 packs the hot state like the original globals, so one command line compares both layouts:
+for %p in (0 1) do @(cl /nologo /O2 /DTMR_PAD_HOT_STATE=%p /FeSW_Timer_sharing_bench%p.exe SW_Timer_sharing_bench.c >nul && SW_Timer_sharing_bench%p.exe)
+(gcc -O2 -pthread -DTMR_PAD_HOT_STATE=<p> SW_Timer_sharing_bench.c on POSIX)
+*/
+
+#define SW_TIMER_NO_MAIN
+#define TMR_STATS 0
+#define TMR_SIM_CLOCK 0 // TMR_SIM_CLOCK_STEP - the benchmark's own ticker plays the hw timer thread
+#include "SW_Timer_executable.c"
+
+#if !TMR_PORT_HOSTED
+#error "The sharing benchmark needs threads, build it for a hosted port"
+#endif
+
+#define SHARING_OPS 50000000 // Compare register writes timed per run
+
+// A variable of the hot state and the thread that writes it, as the engine code is written - not checked against it
+typedef struct {
+	const char* name;
+	const void* p_var;
+	const char* writer;
+} sharing_var_t;
+
+const sharing_var_t sharing_vars[] = {
+	{ "tmr_val_reg", (const void*)&tmr_val_reg, "hw timer" },
+	{ "tmr_swi_reg", (const void*)&tmr_swi_reg, "set_timer" },
+	{ "tmr_channels", (const void*)&tmr_channels[0], "ISR" },
+	{ "hw_irq_lines", (const void*)&hw_irq_lines, "hw timer+ISR" },
+	{ "g_no_errors", (const void*)&g_no_errors, "any" },
+	{ "last_update_timer_value", (const void*)&last_update_timer_value, "ISR" },
+	{ "last_update_time64", (const void*)&last_update_time64, "ISR" },
+	{ "timer_shards_changed", (const void*)&timer_shards_changed, "ISR" },
+	{ "timer_interrupts_saved", (const void*)&timer_interrupts_saved, "ISR" },
+	{ "timer_active_num", (const void*)&timer_active_num, "ISR" },
+	{ "timer_shards[0].cmd_head", (const void*)&timer_shards[0].cmd_head, "set_timer" },
+	{ "timer_shards[0].cmd_tail", (const void*)&timer_shards[0].cmd_tail, "ISR" },
+};
+#define SHARING_VARS_NUM (sizeof(sharing_vars) / sizeof(sharing_vars[0]))
+
+volatile uint32 sharing_ticking = FALSE; // The ticker runs while set
+volatile uint32 sharing_ticker_started = FALSE;
+
+// Ticker thread - increments the timer value as fast as it goes, like the hw timer thread of TMR_SIM_CLOCK_STEP
+void sharing_ticker(void)
+{
+	port_thread_pin(1);
+	sharing_ticker_started = TRUE;
+	while (sharing_ticking)
+		tmr_val_reg++;
+}
+
+// Returns the compare register writes per second of the main thread, each also reads g_no_errors
+double sharing_run(void)
+{
+	uint64 clock_start = port_clock();
+	for (uint32 i = 0; i < SHARING_OPS && *(volatile BOOL*)&g_no_errors; i++)
+		tmr_channels[0].cmp_reg = i;
+	double seconds = (double)(port_clock() - clock_start) / (double)port_clock_freq();
+	return (double)SHARING_OPS / seconds;
+}
+
+int main(void) {
+
+	printf("TMR_PAD_HOT_STATE %d\n", TMR_PAD_HOT_STATE);
+	printf("%-26s %-13s %12s\n", "variable", "writer", "cache line");
+	uintptr_t first_line = (uintptr_t)sharing_vars[0].p_var / TMR_CACHE_LINE;
+	for (uint32 i = 0; i < SHARING_VARS_NUM; i++)
+		if ((uintptr_t)sharing_vars[i].p_var / TMR_CACHE_LINE < first_line)
+			first_line = (uintptr_t)sharing_vars[i].p_var / TMR_CACHE_LINE;
+	for (uint32 i = 0; i < SHARING_VARS_NUM; i++)
+		printf("%-26s %-13s %12llu\n", sharing_vars[i].name, sharing_vars[i].writer,
+			(unsigned long long)((uintptr_t)sharing_vars[i].p_var / TMR_CACHE_LINE - first_line));
+
+	// A line is falsely shared when variables of different writers are on it, counted once at its first variable
+	uint32 shared_lines = 0;
+	for (uint32 i = 0; i < SHARING_VARS_NUM; i++) {
+		uintptr_t line = (uintptr_t)sharing_vars[i].p_var / TMR_CACHE_LINE;
+		BOOL first = TRUE;
+		BOOL shared = FALSE;
+		for (uint32 j = 0; j < SHARING_VARS_NUM; j++) {
+			if ((uintptr_t)sharing_vars[j].p_var / TMR_CACHE_LINE != line)
+				continue;
+			if (j < i)
+				first = FALSE;
+			if (strcmp(sharing_vars[j].writer, sharing_vars[i].writer) != 0)
+				shared = TRUE;
+		}
+		if (first && shared)
+			shared_lines++;
+	}
+	printf("Cache lines written by more than one thread (by address, not measured): %u\n\n", shared_lines);
+
+	port_thread_pin(0);
+	double alone = sharing_run();
+
+	port_thread_t h_ticker;
+	sharing_ticking = TRUE;
+	if (!port_thread_create(&h_ticker, sharing_ticker, FALSE)) {
+		printf("ERROR: Create ticker thread failed\n");
+		return 1;
+	}
+	while (!sharing_ticker_started)
+		port_yield();
+	double ticking = sharing_run();
+	sharing_ticking = FALSE;
+	port_thread_close(&h_ticker);
+
+	printf("%-14s %14s %14s %9s\n", "", "alone Mops/s", "ticking Mops/s", "slowdown");
+	printf("%-14s %14.1f %14.1f %8.2fx\n", "cmp_reg write", alone / 1e6, ticking / 1e6, alone / ticking);
+	return 0;
+}
@@ -0,0 +1,530 @@
+/*
+SW Timer engine test.
+Drives the timer engine with a simulated tmr_val_reg - no hw timer or ISR thread runs, the test calls
+timer_interrupt itself at every compare value - and checks when the timers fire. On Linux it builds in event loop
+mode, whose timerfd only starts for the last check, with two bottom-half workers the test runs itself. Prints a
+line per check and returns non-zero if any failed. The backend is chosen at build time like in the engine:
+for %b in (0 1 2) do @(cl /nologo /O2 /DTMR_BACKEND=%b /FeSW_Timer_test%b.exe SW_Timer_test.c >nul && SW_Timer_test%b.exe)
+(gcc -O2 -pthread -DTMR_BACKEND=<b> SW_Timer_test.c on POSIX)
+*/
+
+#define SW_TIMER_NO_MAIN
+#include "SW_Timer_port.h" // For TMR_PORT_HAS_TIMERFD, first like in the engine
+#ifndef TMR_NUM
+#define TMR_NUM 64 // The wheel backend needs TMR_WHEEL_MIN_NUM timers
+#endif
+#ifndef TMR_HW_CHANNELS
+#define TMR_HW_CHANNELS 3 // The nearest two timers fire from dedicated channels in every check
+#endif
+#ifndef TMR_SIM_CLOCK
+#if TMR_PORT_HAS_TIMERFD
+#define TMR_SIM_CLOCK 3 // TMR_SIM_CLOCK_EVENT_LOOP - no threads, register writes don't arm the timerfd before it is opened
+#else
+#define TMR_SIM_CLOCK 0 // TMR_SIM_CLOCK_STEP - register writes don't wake a tickless hw timer thread
+#endif
+#endif
+#ifndef TMR_ISR_FIRE_CAP
+#define TMR_ISR_FIRE_CAP 4 // Small enough for one check to leave due timers to the next interrupt
+#endif
+#if TMR_SIM_CLOCK == 3 && !defined(TMR_BH_WORKERS)
+#define TMR_BH_WORKERS 2 // Run by the test itself - in event loop mode the bottom half has no threads
+#define TMR_BH_QUEUE_SIZE 8 // Small enough for one check to fill the fire rings
+#endif
+#include "SW_Timer_executable.c"
+
+const char* test_backend_names[] = { "flat", "heap", "wheel" }; // Indexed by TMR_BACKEND
+uint32 test_fires[TMR_NUM]; // Fires of each timer seen by test_fire
+uint32 test_fire_time[TMR_NUM]; // The timer value of each timer's last fire
+uint32 test_failed = 0;
+
+// Callback of every tested timer
+void test_fire(timer_id_t timer_id, void* ctx)
+{
+	test_fires[timer_id]++;
+	test_fire_time[timer_id] = tmr_val_reg;
+}
+
+// Prints the result of a check and counts the failed ones
+void test_report(const char* name, BOOL passed)
+{
+	printf("%-6s %-56s %s\n", test_backend_names[TMR_BACKEND], name, passed ? "OK" : "FAILED");
+	if (!passed)
+		test_failed++;
+}
+
+// This function runs what the interrupts left - the bottom half's fires, and the timer interrupts raised by software
+void test_run_pending()
+{
+	while (timer_bh_run_all() != 0 || tmr_swi_reg) {
+		if (tmr_swi_reg) {
+			tmr_swi_reg = 0;
+			timer_interrupt();
+		}
+	}
+}
+
+// This function runs the timer interrupt raised by a set or remove, and what it left
+void test_interrupt()
+{
+	tmr_swi_reg = 0;
+	timer_interrupt();
+	test_run_pending();
+}
+
+// This function moves the timer value ticks on, running the queue and channel interrupts at their compare values on the way
+void test_advance(uint32 ticks)
+{
+	uint32 target = tmr_val_reg + ticks;
+	while (TRUE) {
+		uint32 channel = 0;
+		uint32 cmp_distance = tmr_channels[0].cmp_reg - tmr_val_reg;
+		for (uint32 i = 1; i < TMR_HW_CHANNELS; i++) {
+			if (tmr_channels[i].en_reg && tmr_channels[i].cmp_reg - tmr_val_reg - 1 < cmp_distance - 1) {
+				channel = i;
+				cmp_distance = tmr_channels[i].cmp_reg - tmr_val_reg;
+			}
+		}
+		if (cmp_distance == 0 || cmp_distance > target - tmr_val_reg)
+			break;
+		tmr_val_reg += cmp_distance;
+		if (channel == 0)
+			test_interrupt();
+		else {
+			timer_channel_interrupt(channel);
+			test_run_pending();
+		}
+	}
+	tmr_val_reg = target;
+}
+
+/* The first timer is set with the counter just before it wraps, long after the zero-initialized time base.
+* It must fire one interval after it was set, not at once with the ticks since 0 taken for overruns.
+*/
+void test_first_set_wrapped()
+{
+	tmr_val_reg = 0xffff0000;
+	uint32 set_time = tmr_val_reg;
+	BOOL set = set_timer_cb(1, 100000, test_fire, NULL);
+	test_interrupt(); // The software interrupt set_timer_cb raised
+	BOOL not_yet = test_fires[1] == 0;
+	test_advance(250000);
+	test_report("first set at 0xffff0000 fires one interval later", set && not_yet && test_fires[1] == 2 &&
+		test_fire_time[1] == set_time + 2 * 100000 && timer_overruns[1] == 0);
+	remove_timer(1);
+	test_interrupt();
+}
+
+/* After an idle stretch of almost TMR_MAX_CMP_DISTANCE, a timer a little over 2^31 ticks long must not fire early -
+* measured from the last interrupt its deadline would be more than 2^32 ticks ahead
+*/
+void test_set_after_idle()
+{
+	test_advance(TMR_MAX_CMP_DISTANCE - 1000);
+	uint32 set_time = tmr_val_reg;
+	BOOL set = set_timer_once(2, 0x80010000, test_fire, NULL);
+	test_interrupt();
+	test_advance(0x80010000 - 1);
+	BOOL not_yet = test_fires[2] == 0;
+	test_advance(1);
+	test_report("one-shot set after idle fires 2^31 + 0x10000 later", set && not_yet && test_fires[2] == 1 &&
+		test_fire_time[2] == set_time + 0x80010000);
+}
+
+// A one-shot timer fires once and is deactivated, its fire count stays 1 until it is set again
+void test_one_shot_count()
+{
+	BOOL set = set_timer_once(3, 5000, test_fire, NULL);
+	test_interrupt();
+	test_advance(20000);
+	BOOL fired_once = test_fires[3] == 1 && timer_times_fired[3] == 1 && !TIMER_IS_ACTIVE(3);
+	set_timer_once(3, 5000, test_fire, NULL);
+	test_interrupt();
+	BOOL rearmed = timer_times_fired[3] == 0 && TIMER_IS_ACTIVE(3);
+	test_advance(5000);
+	test_report("one-shot fire count survives its disarm", set && fired_once && rearmed &&
+		test_fires[3] == 2 && timer_times_fired[3] == 1);
+}
+
+/* A cancel queued right after a set, before any interrupt ran, is applied after the set - the timer ends up
+* inactive and never fires. Likewise through a handle.
+*/
+void test_cancel_before_interrupt()
+{
+	BOOL set = set_timer_cb(4, 100, test_fire, NULL);
+	BOOL removed = remove_timer(4);
+	test_interrupt(); // Applies both commands
+	test_advance(500);
+	test_report("remove right after set cancels the timer", set && removed && !TIMER_IS_ACTIVE(4) && test_fires[4] == 0);
+
+	timer_handle_t handle = sw_timer_create();
+	timer_id_t timer_id = timer_handle_to_id(handle);
+	uint32 fires = timer_id == TMR_INVALID_ID ? 0 : test_fires[timer_id];
+	set = sw_timer_set(handle, 100, test_fire, NULL);
+	BOOL cancelled = sw_timer_cancel(handle);
+	test_interrupt();
+	test_advance(500);
+	test_report("cancel right after set through a handle", timer_id != TMR_INVALID_ID && set && cancelled &&
+		!TIMER_IS_ACTIVE(timer_id) && test_fires[timer_id] == fires && sw_timer_destroy(handle));
+	test_interrupt();
+}
+
+#if TMR_BACKEND == TMR_BACKEND_HEAP && TMR_LAZY_CANCEL
+/* A timer cancelled with its entry left in the heap as a tombstone, then set again until its generation wraps around
+* to the tag of that tombstone - the tombstone must not come alive and fire the timer at its old deadline
+*/
+void test_generation_wrap()
+{
+	for (timer_id_t i = 10; i < 20; i++)
+		set_timer_cb(i, 1000000, NULL, NULL); // Live entries, so the one tombstone doesn't trigger a sweep
+	heap_generation[5] = 0;
+	set_timer_once(5, 5000000, test_fire, NULL); // Tagged 1
+	test_interrupt();
+	remove_timer(5);
+	test_interrupt();
+	heap_generation[5] = HEAP_GENERATION_LAST; // As after 2^31 sets
+	set_timer_once(5, 100, test_fire, NULL);
+	test_interrupt();
+	test_advance(100);
+	BOOL fired = test_fires[5] == 1 && !TIMER_IS_ACTIVE(5);
+	uint32 set_time = tmr_val_reg;
+	set_timer_once(5, 8000000, test_fire, NULL); // Tagged 1 again
+	test_interrupt();
+	test_advance(9000000);
+	test_report("wrapped generation doesn't revive a tombstone", fired && test_fires[5] == 2 &&
+		test_fire_time[5] == set_time + 8000000);
+	for (timer_id_t i = 10; i < 20; i++)
+		remove_timer(i);
+	test_interrupt();
+}
+#endif
+
+#if TMR_HW_CHANNELS >= 3
+/* The nearest timers move to the dedicated HW channels and fire from the channel interrupt exactly at their
+* deadlines, the timer behind them stays in the queue
+*/
+void test_hw_channels()
+{
+	uint32 set_time = tmr_val_reg;
+	set_timer_cb(6, 3000, test_fire, NULL);
+	set_timer_cb(7, 1000, test_fire, NULL);
+	set_timer_cb(8, 2000, test_fire, NULL);
+	test_interrupt();
+	BOOL on_channels = hw_channel_of(7) != 0 && hw_channel_of(8) != 0 && hw_channel_of(6) == 0;
+	uint64 channel_calls = channel_isr_stats.calls;
+	test_advance(1000);
+	BOOL channel_fired = test_fires[7] == 1 && test_fire_time[7] == set_time + 1000 && channel_isr_stats.calls == channel_calls + 1;
+	test_advance(5000);
+	test_report("nearest timers fire from the dedicated channels", on_channels && channel_fired &&
+		test_fires[7] == 6 && test_fires[8] == 3 && test_fires[6] == 2 &&
+		test_fire_time[7] == set_time + 6000 && test_fire_time[8] == set_time + 6000 && test_fire_time[6] == set_time + 6000);
+	for (timer_id_t i = 6; i <= 8; i++)
+		remove_timer(i);
+	test_interrupt();
+}
+#endif
+
+// A timer whose slack window is open at another timer's deadline fires in the same interrupt, one interrupt for both
+void test_slack_coalescing()
+{
+	uint32 set_time = tmr_val_reg;
+	set_timer_slack(9, 1000, 0, test_fire, NULL);
+	set_timer_slack(10, 900, 300, test_fire, NULL); // Due in [900, 1200]
+	test_interrupt();
+	uint32 saved = timer_interrupts_saved;
+	uint64 isr_calls = timer_isr_stats.calls + channel_isr_stats.calls;
+	test_advance(1000);
+	test_report("slack timer shares the interrupt of an earlier deadline", test_fires[9] == 1 && test_fires[10] == 1 &&
+		test_fire_time[9] == set_time + 1000 && test_fire_time[10] == set_time + 1000 &&
+		timer_interrupts_saved == saved + 1 && timer_isr_stats.calls + channel_isr_stats.calls == isr_calls + 1);
+	remove_timer(9);
+	remove_timer(10);
+	test_interrupt();
+}
+
+/* A batch is applied by the one interrupt it raises, every timer measured from the same timer value, and a batch
+* with an invalid request sets none of its timers
+*/
+void test_batch()
+{
+	timer_req_t reqs[8];
+	uint32 set_time = tmr_val_reg;
+	for (uint32 i = 0; i < 8; i++) {
+		timer_req_t req = { 20 + i, 1000 * (i + 1), 0, test_fire, NULL };
+		reqs[i] = req;
+	}
+	BOOL set = set_timers_batch(reqs, 8);
+	test_interrupt();
+	BOOL applied = timer_shards[0].cmd_head == timer_shards[0].cmd_tail;
+	for (uint32 i = 0; i < 8; i++)
+		applied = applied && TIMER_IS_ACTIVE(20 + i);
+	test_advance(8000);
+	BOOL on_time = TRUE;
+	for (uint32 i = 0; i < 8; i++) {
+		uint32 fires = 8 / (i + 1);
+		on_time = on_time && test_fires[20 + i] == fires && test_fire_time[20 + i] == set_time + fires * 1000 * (i + 1);
+		remove_timer(20 + i);
+	}
+	test_interrupt();
+
+	reqs[7].timer_id = TMR_NUM; // Invalid
+	BOOL rejected = !set_timers_batch(reqs, 8) && timer_shards[0].cmd_head == timer_shards[0].cmd_tail;
+	test_report("batch applied by one interrupt, invalid batch sets none", set && applied && on_time && rejected);
+}
+
+/* A timer set to an absolute tick fires exactly there, also when the interrupt that applies it runs late, and a
+* tick that is not ahead is rejected
+*/
+void test_absolute_deadline()
+{
+	uint32 abs_tick = tmr_val_reg + 5000;
+	BOOL set = set_timer_at(11, abs_tick, test_fire, NULL);
+	tmr_val_reg += 2000; // The interrupt runs 2000 ticks after the call
+	test_interrupt();
+	test_advance(2999);
+	BOOL not_yet = test_fires[11] == 0;
+	test_advance(10000);
+	test_report("absolute deadline kept across a late interrupt", set && not_yet && test_fires[11] == 1 &&
+		test_fire_time[11] == abs_tick && !TIMER_IS_ACTIVE(11) && !set_timer_at(11, tmr_val_reg, test_fire, NULL));
+}
+
+/* A periodic timer whose interrupt runs periods late fires once, counts the periods it skipped as overruns, and
+* keeps its deadlines on the grid of its first set
+*/
+void test_periodic_overrun()
+{
+	uint32 set_time = tmr_val_reg;
+	set_timer_cb(12, 1000, test_fire, NULL);
+	test_interrupt();
+	test_advance(1000);
+	tmr_val_reg = set_time + 3500; // Interrupts blocked past the deadlines at 2000 and 3000
+	test_interrupt();
+	BOOL collapsed = test_fires[12] == 2 && test_fire_time[12] == set_time + 3500 && timer_overruns[12] == 1;
+	test_advance(500);
+	test_report("late periodic timer fires once, keeps its grid", collapsed && test_fires[12] == 3 &&
+		test_fire_time[12] == set_time + 4000 && timer_overruns[12] == 1);
+	remove_timer(12);
+	test_interrupt();
+}
+
+/* timer_now64 keeps counting across the 32-bit timer value wrap, and a long periodic timer and an absolute 64-bit
+* deadline more than a wrap ahead fire exactly there, not a wrap early
+*/
+void test_now64_wrap()
+{
+	uint64 start = timer_now64();
+	uint64 abs_time = start + 0x100000000ULL + 5000;
+	BOOL set = set_timer_at64(13, abs_time, test_fire, NULL) &&
+		set_timer_long(14, 0x100000000ULL + 2000, test_fire, NULL);
+	test_interrupt();
+	test_advance(0x80000000);
+	test_advance(0x80000000 + 4999);
+	BOOL counted = timer_now64() == abs_time - 1 && test_fires[13] == 0 && test_fires[14] == 1 &&
+		test_fire_time[14] == (uint32)(start + 0x100000000ULL + 2000);
+	test_advance(1);
+	test_report("64-bit timer value and long timers across a wrap", set && counted && test_fires[13] == 1 &&
+		test_fire_time[13] == (uint32)abs_time && timer_now64() == abs_time && !TIMER_IS_ACTIVE(13));
+	remove_timer(14);
+	test_interrupt();
+}
+
+/* More queued timers due at once than TMR_ISR_FIRE_CAP, besides the channel timers - the interrupt fires the cap
+* and raises the next one by software, which fires the rest at the same timer value
+*/
+void test_fire_cap()
+{
+	uint32 set_time = tmr_val_reg;
+	uint64 capped = timer_isr_capped;
+	for (timer_id_t i = 30; i < 30 + TMR_ISR_FIRE_CAP + TMR_HW_CHANNELS; i++)
+		set_timer_cb(i, 1000, test_fire, NULL);
+	test_interrupt();
+	test_advance(1000);
+	BOOL all_fired = TRUE;
+	for (timer_id_t i = 30; i < 30 + TMR_ISR_FIRE_CAP + TMR_HW_CHANNELS; i++) {
+		all_fired = all_fired && test_fires[i] == 1 && test_fire_time[i] == set_time + 1000;
+		remove_timer(i);
+	}
+	test_interrupt();
+	test_report("timers past TMR_ISR_FIRE_CAP fire from the next interrupt", all_fired && timer_isr_capped == capped + 1);
+}
+
+#if TMR_BH_WORKERS > 0 && !TMR_BH_THREADS
+/* More timers due at once than the fire rings hold - the interrupts stall without overfilling a ring, and the
+* worker that makes room raises the interrupt that fires the rest
+*/
+void test_bh_ring_full()
+{
+	const timer_id_t first = 40, timers_num = 2 * TMR_BH_QUEUE_SIZE;
+	uint32 set_time = tmr_val_reg;
+	uint64 stalls = timer_bh_stalls;
+	for (timer_id_t i = first; i < first + timers_num; i++)
+		set_timer_cb(i, 1000, test_fire, NULL);
+	test_interrupt();
+	tmr_val_reg += 1000;
+	for (uint32 i = 0; i < timers_num; i++) {
+		// The interrupts the fires raise, with the workers not run
+		tmr_swi_reg = 0;
+		timer_interrupt();
+	}
+	BOOL in_bounds = TRUE;
+	uint32 top_fired = 0;
+	for (uint32 worker = 0; worker < TMR_BH_WORKERS; worker++)
+		in_bounds = in_bounds && timer_bh_workers[worker].fire_head - timer_bh_workers[worker].fire_tail <= TMR_BH_QUEUE_SIZE;
+	for (timer_id_t i = first; i < first + timers_num; i++)
+		top_fired += timer_times_fired[i];
+	BOOL stalled = timer_bh_stalled && timer_bh_stalls > stalls && top_fired < timers_num && test_fires[first] == 0;
+	test_run_pending();
+	BOOL all_fired = TRUE;
+	for (timer_id_t i = first; i < first + timers_num; i++) {
+		all_fired = all_fired && test_fires[i] == 1 && test_fire_time[i] == set_time + 1000;
+		remove_timer(i);
+	}
+	test_interrupt();
+	test_report("full fire rings stall the interrupt, the workers resume it", in_bounds && stalled && all_fired &&
+		!timer_bh_stalled);
+}
+#endif
+
+/* A snapshot between interrupts holds every active timer with its time left, and the aggregate counts them - a
+* snapshot taken while an ISR holds the state is retried, and fails once the ISR doesn't finish
+*/
+void test_snapshot()
+{
+	timer_aggregate_t before;
+	BOOL taken = timer_snapshot_aggregate(&before);
+	set_timer_slack(50, 1000, 200, test_fire, NULL); // Alone, fires at its hard expiry 1200
+	set_timer_once(51, 5000, test_fire, NULL);
+	set_timer_long(52, 0x100000007ULL, test_fire, NULL);
+	test_interrupt();
+	test_advance(1500);
+
+	timer_aggregate_t aggregate;
+	timer_snapshot_entry_t entries[TMR_NUM];
+	uint32 entries_num = 0;
+	taken = taken && timer_snapshot(&aggregate, entries, TMR_NUM, &entries_num);
+	BOOL found[3] = { FALSE, FALSE, FALSE };
+	for (uint32 i = 0; i < entries_num; i++) {
+		const timer_snapshot_entry_t* p_entry = &entries[i];
+		if (p_entry->timer_id == 50)
+			found[0] = p_entry->mode == TMR_MODE_PERIODIC && p_entry->wait_us == 1000 && p_entry->slack_us == 200 &&
+				p_entry->remain_us == 700 && p_entry->times_fired == 1;
+		else if (p_entry->timer_id == 51)
+			found[1] = p_entry->mode == TMR_MODE_ONE_SHOT && p_entry->wait_us == 5000 && p_entry->remain_us == 3500 &&
+				p_entry->times_fired == 0;
+		else if (p_entry->timer_id == 52)
+			found[2] = p_entry->wait_us == 0x100000007ULL && p_entry->remain_us == 0x100000007ULL - 1500;
+	}
+	BOOL counted = aggregate.time64 == timer_now64() && aggregate.active_num == before.active_num + 3 &&
+		entries_num == aggregate.active_num && aggregate.slack_num == before.slack_num + 1 &&
+		aggregate.fires_total == before.fires_total + 1 && aggregate.next_deadline64 == aggregate.time64 + 700;
+	test_report("snapshot of the active timers and their aggregate", taken && found[0] && found[1] && found[2] && counted);
+
+	timer_state_write_begin(); // As if an ISR never finished
+	BOOL retried_out = !timer_snapshot_aggregate(&aggregate);
+	timer_state_write_end();
+	test_report("snapshot fails while an ISR holds the state", retried_out && timer_snapshot_aggregate(&aggregate));
+	for (timer_id_t i = 50; i <= 52; i++)
+		remove_timer(i);
+	test_interrupt();
+}
+
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+/* In event loop mode no ISR thread drains the command ring - a batch larger than the ring runs the interrupt inline
+* to make room, and sets every timer. Runs last, the timerfd drives the timer value from then on.
+*/
+void test_event_loop_batch()
+{
+	static timer_req_t reqs[TMR_CMD_QUEUE_SIZE + TMR_NUM];
+	for (uint32 i = 0; i < TMR_CMD_QUEUE_SIZE + TMR_NUM; i++) {
+		timer_req_t req = { i % TMR_NUM, 10000000, 0, test_fire, NULL };
+		reqs[i] = req;
+	}
+	BOOL opened = timer_event_loop_open() >= 0;
+	BOOL set = opened && set_timers_batch(reqs, TMR_CMD_QUEUE_SIZE + TMR_NUM);
+	if (opened)
+		timer_event_loop_dispatch();
+	BOOL all_active = TRUE;
+	for (timer_id_t i = 0; i < TMR_NUM; i++)
+		all_active = all_active && TIMER_IS_ACTIVE(i);
+	test_report("event loop batch larger than the command ring", set && all_active &&
+		timer_shards[0].cmd_head == timer_shards[0].cmd_tail);
+}
+#endif
+
+/* A destroyed timer's handle is stale for set, cancel and destroy, also once its ID is handed out again.
+* The new handle of the ID works, a destroyed armed timer doesn't fire any more.
+*/
+void test_handles()
+{
+	timer_handle_t handle = sw_timer_create();
+	timer_id_t timer_id = timer_handle_to_id(handle);
+	if (timer_id == TMR_INVALID_ID) {
+		test_report("timer created", FALSE);
+		return;
+	}
+	uint32 fires = test_fires[timer_id];
+	BOOL set = sw_timer_set(handle, 10000, test_fire, NULL);
+	test_interrupt();
+	test_advance(25000);
+	BOOL fired = test_fires[timer_id] == fires + 2;
+	BOOL destroyed = sw_timer_destroy(handle); // While armed
+	test_interrupt();
+	test_advance(50000);
+	test_report("destroyed armed timer stops firing", set && fired && destroyed &&
+		test_fires[timer_id] == fires + 2 && !TIMER_IS_ACTIVE(timer_id));
+
+	BOOL stale = !sw_timer_set(handle, 10000, test_fire, NULL) && !sw_timer_cancel(handle) && !sw_timer_destroy(handle);
+	timer_handle_t new_handle = sw_timer_create();
+	BOOL reused = new_handle != handle && timer_handle_to_id(new_handle) == timer_id;
+	stale = stale && !sw_timer_set(handle, 10000, test_fire, NULL) && !sw_timer_cancel(handle);
+	set = sw_timer_set(new_handle, 10000, test_fire, NULL);
+	test_interrupt();
+	BOOL cancelled = sw_timer_cancel(new_handle);
+	test_interrupt();
+	test_advance(20000);
+	test_report("stale handle rejected, reused ID gets a new handle", stale && reused && set && cancelled &&
+		test_fires[timer_id] == fires + 2 && sw_timer_destroy(new_handle));
+
+	// The generation after 0xffffffff is 1 again, never 0 - handle 0 is TMR_INVALID_HANDLE
+	timer_generation[timer_id] = 0xffffffff;
+	timer_handle_t last_handle = sw_timer_create();
+	BOOL last = timer_handle_to_id(last_handle) == timer_id && (uint32)(last_handle >> 32) == 0xffffffff;
+	sw_timer_destroy(last_handle);
+	timer_handle_t wrapped_handle = sw_timer_create();
+	test_report("handle generation wraps around to 1", last && timer_handle_to_id(wrapped_handle) == timer_id &&
+		(uint32)(wrapped_handle >> 32) == 1 && timer_handle_to_id(last_handle) == TMR_INVALID_ID);
+	sw_timer_destroy(wrapped_handle);
+	test_interrupt();
+}
+
+int main() {
+
+	queue_init();
+	test_first_set_wrapped();
+	test_set_after_idle();
+	test_one_shot_count();
+	test_cancel_before_interrupt();
+#if TMR_HW_CHANNELS >= 3
+	test_hw_channels();
+#endif
+	test_slack_coalescing();
+	test_batch();
+	test_absolute_deadline();
+	test_periodic_overrun();
+	test_now64_wrap();
+	test_fire_cap();
+#if TMR_BH_WORKERS > 0 && !TMR_BH_THREADS
+	test_bh_ring_full();
+#endif
+	test_snapshot();
+#if TMR_BACKEND == TMR_BACKEND_HEAP && TMR_LAZY_CANCEL
+	test_generation_wrap();
+#endif
+	test_handles();
+
+#if TMR_SIM_CLOCK == TMR_SIM_CLOCK_EVENT_LOOP
+	test_event_loop_batch(); // Last, it starts the timerfd
+#endif
+
+	printf("%u checks failed\n", test_failed);
+	return test_failed != 0;
+}